@@ -0,0 +1,291 @@
+#include "chip8.h"
+#include "rom_cache.h"
+#include "quirks.h"
+#include <cstdio>
+#include <atomic>
+#include <thread>
+#include <filesystem>
+#include <sstream>
+#include <algorithm>
+
+// Headless batch runner, runs every ROM of a collection on its own Chip8 across all cores and prints the final state
+
+struct Job {
+    std::string path;
+    int chip;
+};
+
+struct Result {
+    uint64_t executed = 0;
+    uint16_t PC = 0;
+    uint16_t I = 0;
+    uint8_t V[16] = {};
+    uint64_t hash = 0; // FNV-1a of the active screen
+    bool running = false;
+    int fault = Chip8::NO_FAULT;
+    std::string error; // Empty if the ROM loaded
+};
+
+static void usage() {
+    fprintf(stderr, "Usage: chip8-batch [-c 1|2|3] [-n instructions | -f frames] [-m mode] [-j threads] [-s seed] [-x runs] [-q profiles] [-p] [-l manifest]... [rom | directory]...\n");
+    fprintf(stderr, "  -c  1 for CHIP8 (default), 2 for SUPER_CHIP or 3 for SUPER_CHIP legacy (SCHIP 1.1), manifests can override it per ROM\n");
+    fprintf(stderr, "  -n  instructions to run per ROM\n");
+    fprintf(stderr, "  -f  60 Hz frames to run per ROM (default 3600)\n");
+    fprintf(stderr, "  -m  interpreter (default), blocks or jit\n");
+    fprintf(stderr, "  -j  worker threads (default all cores)\n");
+    fprintf(stderr, "  -s  CXNN seed (default 0), every ROM starts from it so tables are reproducible\n");
+    fprintf(stderr, "  -x  runs per ROM (default 1), restarted from the loaded image with seeds s, s+1, ..., the table shows the last run and total cycles\n");
+    fprintf(stderr, "  -q  quirk profiles to add to the built-in ones, see quirks.h\n");
+    fprintf(stderr, "  -p  prints a quirk profile line per ROM with the quirks it loads with instead of running, to start a profile file from\n");
+    fprintf(stderr, "  -l  manifest, one \"path [1|2|3]\" per line, # starts a comment, paths are relative to the manifest\n");
+}
+
+static bool read_manifest(const std::string& path, int chip, std::vector<Job>& jobs) {
+    std::ifstream manifest(path);
+    if (!manifest) {
+        fprintf(stderr, "%s: could not open manifest\n", path.c_str());
+        return false;
+    }
+
+    std::filesystem::path base = std::filesystem::path(path).parent_path();
+    std::string line;
+    int number = 0;
+
+    while (std::getline(manifest, line)) {
+        ++number;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+
+        std::istringstream fields(line);
+        std::string rom;
+        if (!(fields >> rom)) {
+            continue; // Blank line
+        }
+
+        int rom_chip = chip;
+        if (fields >> rom_chip && (rom_chip < Chip8::CHIP_8 || rom_chip > Chip8::SUPER_CHIP_LEGACY)) {
+            fprintf(stderr, "%s:%d: chip type must be 1, 2 or 3\n", path.c_str(), number);
+            return false;
+        }
+        jobs.push_back({(base / rom).string(), rom_chip});
+    }
+    return true;
+}
+
+static void add_directory(const std::string& path, int chip, std::vector<Job>& jobs) {
+    std::vector<std::string> roms;
+    for (const auto& entry : std::filesystem::directory_iterator(path)) {
+        if (entry.is_regular_file()) {
+            roms.push_back(entry.path().string());
+        }
+    }
+    std::sort(roms.begin(), roms.end()); // Stable table order between runs
+
+    for (const std::string& rom : roms) {
+        jobs.push_back({rom, chip});
+    }
+}
+
+static void run_job(const Job& job, RomCache& roms, int mode, uint64_t seed, uint64_t budget, int runs, Result& result) {
+    Chip8 emulator{job.chip};
+    try {
+        roms.load(emulator, job.path); // Each file is read once however often it is listed
+    }
+    catch (const std::exception& e) {
+        result.error = e.what();
+        return;
+    }
+    emulator.set_mode(mode);
+    emulator.snapshot_pristine();
+
+    const uint64_t cycles_per_frame = Chip8::cycles_per_frame(job.chip);
+
+    for (int run = 0; run < runs; ++run) {
+        if (run > 0) {
+            emulator.restart(); // Copies back only the memory the last run stored to
+        }
+        emulator.set_seed(seed + run);
+
+        uint64_t executed = 0;
+        while (executed < budget && emulator.is_running()) {
+            executed += emulator.run(std::min(cycles_per_frame, budget - executed));
+            emulator.tick_timers();
+        }
+        result.executed += executed;
+    }
+
+    result.PC = emulator.get_pc();
+    result.I = emulator.get_index();
+    for (uint8_t x = 0; x < 16; ++x) {
+        result.V[x] = emulator.get_register(x);
+    }
+    result.hash = emulator.screen_hash();
+    result.running = emulator.is_running();
+    result.fault = emulator.get_fault();
+}
+
+static int print_profiles(const std::vector<Job>& jobs) {
+    // "hash quirks name" as load_quirk_profiles reads it, edited by hand for ROMs that need other quirks
+    RomCache roms;
+    int failed = 0;
+    for (const Job& job : jobs) {
+        try {
+            Chip8 emulator{job.chip};
+            roms.load(emulator, job.path);
+            printf("%016llX %s %s\n", static_cast<unsigned long long>(roms.get(job.path)->hash()),
+                quirk_names(emulator.get_quirks()).c_str(), std::filesystem::path(job.path).filename().string().c_str());
+        }
+        catch (const std::exception& e) {
+            fprintf(stderr, "%s: %s\n", job.path.c_str(), e.what());
+            ++failed;
+        }
+    }
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    int chip = Chip8::CHIP_8;
+    uint64_t instructions = 0;
+    uint64_t frames = 3600;
+    int mode = Chip8::INTERPRETER;
+    unsigned threads = std::thread::hardware_concurrency();
+    uint64_t seed = 0;
+    int runs = 1;
+    bool profiles = false;
+    std::vector<Job> jobs;
+
+    try { // std::sto* throws on a number that does not parse
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "-c" && i + 1 < argc) {
+                chip = std::stoi(argv[++i]);
+                if (chip < Chip8::CHIP_8 || chip > Chip8::SUPER_CHIP_LEGACY) {
+                    usage();
+                    return 1;
+                }
+            }
+            else if (arg == "-n" && i + 1 < argc) {
+                instructions = std::stoull(argv[++i]);
+            }
+            else if (arg == "-f" && i + 1 < argc) {
+                frames = std::stoull(argv[++i]);
+            }
+            else if (arg == "-m" && i + 1 < argc) {
+                if (!Chip8::parse_mode(argv[++i], mode)) {
+                    usage();
+                    return 1;
+                }
+            }
+            else if (arg == "-j" && i + 1 < argc) {
+                threads = std::stoul(argv[++i]);
+            }
+            else if (arg == "-x" && i + 1 < argc) {
+                runs = std::stoi(argv[++i]);
+                if (runs < 1) {
+                    usage();
+                    return 1;
+                }
+            }
+            else if (arg == "-s" && i + 1 < argc) {
+                seed = std::stoull(argv[++i]);
+            }
+            else if (arg == "-q" && i + 1 < argc) {
+                try {
+                    load_quirk_profiles(argv[++i]); // Before any worker starts
+                }
+                catch (const std::exception& error) {
+                    fprintf(stderr, "%s: %s\n", argv[i], error.what());
+                    return 1;
+                }
+            }
+            else if (arg == "-p") {
+                profiles = true;
+            }
+            else if (arg == "-l" && i + 1 < argc) {
+                if (!read_manifest(argv[++i], chip, jobs)) {
+                    return 1;
+                }
+            }
+            else if (!arg.empty() && arg[0] == '-') {
+                usage();
+                return 1;
+            }
+            else if (std::filesystem::is_directory(arg)) {
+                add_directory(arg, chip, jobs);
+            }
+            else {
+                jobs.push_back({arg, chip});
+            }
+        }
+    }
+    catch (const std::exception&) {
+        usage();
+        return 1;
+    }
+
+    if (jobs.empty()) {
+        usage();
+        return 1;
+    }
+    threads = std::max(1u, std::min<unsigned>(threads, jobs.size()));
+
+    if (profiles) {
+        return print_profiles(jobs);
+    }
+
+    // Each worker takes the next ROM from a shared counter, so long ROMs never hold up a queue of short ones
+    std::vector<Result> results(jobs.size());
+    std::atomic<size_t> next{0};
+    RomCache roms;
+
+    auto worker = [&]() {
+        for (size_t i = next.fetch_add(1, std::memory_order_relaxed); i < jobs.size(); i = next.fetch_add(1, std::memory_order_relaxed)) {
+            uint64_t budget = instructions ? instructions : frames * Chip8::cycles_per_frame(jobs[i].chip);
+            run_job(jobs[i], roms, mode, seed, budget, runs, results[i]);
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) {
+        pool.emplace_back(worker);
+    }
+    worker(); // The main thread works too
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Results table, in input order
+    printf("%-40s %4s %12s %4s %4s %-32s %-16s %s\n", "rom", "chip", "cycles", "PC", "I", "V0-VF", "screen", "status");
+    uint64_t total = 0;
+    int failed = 0;
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        const Result& result = results[i];
+        if (!result.error.empty()) {
+            printf("%-40s %4d %12s %4s %4s %-32s %-16s error: %s\n", jobs[i].path.c_str(), jobs[i].chip, "-", "-", "-", "-", "-", result.error.c_str());
+            ++failed;
+            continue;
+        }
+
+        char registers[33];
+        for (int x = 0; x < 16; ++x) {
+            snprintf(registers + 2*x, 3, "%02X", result.V[x]);
+        }
+
+        printf("%-40s %4d %12llu %04X %04X %s %016llX %s\n", jobs[i].path.c_str(), jobs[i].chip,
+            static_cast<unsigned long long>(result.executed), result.PC, result.I, registers,
+            static_cast<unsigned long long>(result.hash), result.fault ? Chip8::fault_name(result.fault) : (result.running ? "ok" : "stopped"));
+        total += result.executed;
+    }
+
+    fprintf(stderr, "%zu ROMs, %llu instructions in %.3f s on %u threads, %.2f M instructions/s\n", jobs.size(),
+        static_cast<unsigned long long>(total), elapsed.count(), threads, total / elapsed.count() / 1e6);
+
+    return failed ? 2 : 0;
+}
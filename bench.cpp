@@ -0,0 +1,494 @@
+#include "chip8.h"
+#include "replay.h"
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <filesystem>
+#include <atomic>
+#include <new>
+
+// Headless microbenchmark, runs ROMs without SDL and reports interpreter throughput
+
+// Every heap allocation in the process is counted, the suite reports how many happen while a ROM runs
+static std::atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size) {
+    ++allocations;
+    if (void* memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: chip8-bench [-c 1|2|3] [-n instructions] [-m mode] [-d] [-r replay] rom...\n");
+    fprintf(stderr, "  -c  1 for CHIP8 (default), 2 for SUPER_CHIP or 3 for SUPER_CHIP legacy (SCHIP 1.1)\n");
+    fprintf(stderr, "  -n  instructions to run per ROM (default 50000000)\n");
+    fprintf(stderr, "  -m  interpreter (default), blocks or jit\n");
+    fprintf(stderr, "  -d  differential test, runs the mode and the interpreter in lockstep and compares state\n");
+    fprintf(stderr, "  -r  plays a recorded session on one ROM instead, chip and length come from the recording\n");
+    fprintf(stderr, "Suite: chip8-bench -s [-n instructions] [-k samples] [-o results.json] [-b baseline.json] [-t tolerance]\n");
+    fprintf(stderr, "  -s  runs the built-in ROMs in every mode (default 20000000 instructions each)\n");
+    fprintf(stderr, "  -k  samples per case (default 5), taken in rounds over the suite after an untimed one, the best is reported\n");
+    fprintf(stderr, "  -o  writes the results as JSON\n");
+    fprintf(stderr, "  -b  fails if a result is slower than the baseline by more than the tolerance or allocates more\n");
+    fprintf(stderr, "  -t  allowed slowdown, 0.25 (default) is 25%%\n");
+}
+
+static bool lockstep(const std::string& path, int chip, int mode, uint64_t budget, int cycles_per_frame) {
+    // Runs one frame at a time in both machines, the odd frame length also stops blocks midway
+    Chip8 reference{chip};
+    Chip8 tested{chip};
+    reference.load_game(path);
+    tested.load_game(path);
+    tested.set_mode(mode);
+    reference.set_seed(0); // Same CXNN sequence in both
+    tested.set_seed(0);
+
+    uint64_t executed = 0;
+    while (executed < budget && reference.is_running()) {
+        reference.run(cycles_per_frame);
+        executed += tested.run(cycles_per_frame);
+        reference.tick_timers();
+        tested.tick_timers();
+
+        if (!tested.matches(reference)) {
+            printf("%-40s MISMATCH after %llu instructions\n", path.c_str(), static_cast<unsigned long long>(executed));
+            return false;
+        }
+    }
+
+    printf("%-40s %12llu instructions match\n", path.c_str(), static_cast<unsigned long long>(executed));
+    return true;
+}
+
+static bool replay(const std::string& path, const std::string& recording, int mode) {
+    // Replays are bit-exact, so the screen hash can be compared between builds
+    Replay session = load_replay(recording);
+    if (rom_hash(path) != session.rom) {
+        fprintf(stderr, "%s: not the ROM %s was recorded with\n", path.c_str(), recording.c_str());
+        return false;
+    }
+
+    Chip8 emulator{session.chip};
+    emulator.load_game(path);
+    emulator.set_mode(mode);
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t executed = play(emulator, session);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    double seconds = elapsed.count();
+
+    printf("%-40s %12llu instructions %9.3f s %10.2f M instructions/s screen %016llX\n", path.c_str(),
+        static_cast<unsigned long long>(executed), seconds, executed / seconds / 1e6,
+        static_cast<unsigned long long>(emulator.screen_hash()));
+    return executed == session.length();
+}
+
+// Built-in suite, small loops that each stress one part of the core
+struct SuiteRom {
+    const char* name;
+    int chip;
+    std::vector<uint8_t> code;
+};
+
+static std::vector<SuiteRom> suite_roms() {
+    std::vector<uint8_t> sprite(32, 0xA5); // Sprite data at 0x220
+    std::vector<SuiteRom> roms = {
+        {"arith", Chip8::CHIP_8, { // ALU loop
+            0x70, 0x01, // 200: V0 += 1
+            0x81, 0x04, // 202: V1 += V0
+            0x82, 0x13, // 204: V2 ^= V1
+            0x83, 0x26, // 206: V3 = V2 >> 1
+            0x84, 0x31, // 208: V4 |= V3
+            0x12, 0x00, // 20A: jump 200
+        }},
+        {"sprite", Chip8::CHIP_8, { // DXYN flood, 15 row sprites walking across the screen
+            0xA2, 0x20, // 200: I = 220
+            0xD0, 0x1F, // 202: draw 8x15 at V0, V1
+            0x70, 0x03, // 204: V0 += 3
+            0x71, 0x05, // 206: V1 += 5
+            0x12, 0x02, // 208: jump 202
+        }},
+        {"scroll", Chip8::SUPER_CHIP, { // High resolution 16x16 sprites and scrolling
+            0x00, 0xFF, // 200: high resolution
+            0xA2, 0x20, // 202: I = 220
+            0xD0, 0x10, // 204: draw 16x16 at V0, V1
+            0x00, 0xC1, // 206: scroll down 1
+            0x00, 0xFB, // 208: scroll right
+            0x00, 0xFC, // 20A: scroll left
+            0x70, 0x07, // 20C: V0 += 7
+            0x12, 0x04, // 20E: jump 204
+        }},
+        {"hires", Chip8::SUPER_CHIP, { // DXYN flood in high resolution, 8x15 and 16x16 sprites
+            0x00, 0xFF, // 200: high resolution
+            0xA2, 0x20, // 202: I = 220
+            0xD0, 0x1F, // 204: draw 8x15 at V0, V1
+            0xD1, 0x00, // 206: draw 16x16 at V1, V0
+            0x70, 0x03, // 208: V0 += 3
+            0x71, 0x05, // 20A: V1 += 5
+            0x12, 0x04, // 20C: jump 204
+        }},
+        {"pong", Chip8::CHIP_8, { // Mostly static screen, one ball drawn and erased per frame
+            0xA2, 0x20, // 200: I = 220
+            0xD0, 0x11, // 202: draw 8x1 at V0, V1
+            0x72, 0x01, // 204: V2 += 1, six times as game logic
+            0x72, 0x01, // 206
+            0x72, 0x01, // 208
+            0x72, 0x01, // 20A
+            0x72, 0x01, // 20C
+            0x72, 0x01, // 20E
+            0xD0, 0x11, // 210: erase
+            0x70, 0x01, // 212: V0 += 1
+            0x12, 0x02, // 214: jump 202
+        }},
+        {"random", Chip8::CHIP_8, { // CXNN loop
+            0xC0, 0xFF, // 200: V0 = random
+            0xC1, 0x0F, // 202: V1 = random & 0F
+            0x80, 0x14, // 204: V0 += V1
+            0x12, 0x00, // 206: jump 200
+        }},
+    };
+
+    for (SuiteRom& rom : roms) {
+        rom.code.resize(0x20, 0);
+        rom.code.insert(rom.code.end(), sprite.begin(), sprite.end());
+    }
+    return roms;
+}
+
+struct SuiteResult {
+    std::string name;
+    std::string mode;
+    double instructions_per_second;
+    double ns_per_frame; // run(), timers and the ARGB conversion when the screen changed
+    double display_ns_per_frame; // Only the ARGB conversion
+    uint64_t allocations;
+};
+
+// A slower ns/frame only counts once it is also this much slower, a few ns is scheduler noise on the shortest frames
+static constexpr double NOISE_FLOOR_NS = 5;
+
+static SuiteResult run_suite_rom(const SuiteRom& rom, int mode, uint64_t budget) {
+    Chip8 emulator{rom.chip};
+    emulator.load_rom(rom.code.data(), rom.code.size());
+    emulator.set_mode(mode);
+    emulator.set_seed(0);
+
+    const int cycles_per_frame = Chip8::cycles_per_frame(rom.chip);
+    static uint32_t pixels[128 * 64];
+
+    uint64_t executed = 0;
+    uint64_t frames = 0;
+    double display_seconds = 0;
+    uint64_t allocated = allocations;
+    auto start = std::chrono::steady_clock::now();
+
+    while (executed < budget && emulator.is_running()) {
+        executed += emulator.run(cycles_per_frame);
+        emulator.tick_timers();
+
+        if (emulator.get_display_changed()) { // Same work as the frontend, at most once per frame
+            auto display_start = std::chrono::steady_clock::now();
+            emulator.get_argb(pixels, emulator.get_dirty_rows());
+            emulator.set_display_changed(false);
+            emulator.clear_dirty_rows();
+            display_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - display_start).count();
+        }
+        ++frames;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return {rom.name, Chip8::mode_name(mode), executed / elapsed.count(), elapsed.count() * 1e9 / frames,
+        display_seconds * 1e9 / frames, allocations - allocated};
+}
+
+static bool write_json(const std::string& path, uint64_t budget, const std::vector<SuiteResult>& results) {
+    FILE* out = fopen(path.c_str(), "w");
+    if (!out) {
+        return false;
+    }
+
+    // One result per line, read_baseline relies on it
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"results\": [\n", static_cast<unsigned long long>(budget));
+    for (size_t i = 0; i < results.size(); ++i) {
+        const SuiteResult& r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"mode\": \"%s\", \"instructions_per_second\": %.0f, \"ns_per_frame\": %.2f, "
+            "\"display_ns_per_frame\": %.2f, \"allocations\": %llu}%s\n", r.name.c_str(), r.mode.c_str(),
+            r.instructions_per_second, r.ns_per_frame, r.display_ns_per_frame,
+            static_cast<unsigned long long>(r.allocations), (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    fclose(out);
+    return true;
+}
+
+static std::string json_string(const std::string& line, const std::string& key) {
+    size_t at = line.find("\"" + key + "\": \"");
+    if (at == std::string::npos) {
+        return "";
+    }
+    at += key.size() + 5;
+    return line.substr(at, line.find('"', at) - at);
+}
+
+static double json_number(const std::string& line, const std::string& key) {
+    size_t at = line.find("\"" + key + "\": ");
+    if (at == std::string::npos) {
+        return 0;
+    }
+    return std::strtod(line.c_str() + at + key.size() + 4, nullptr);
+}
+
+static std::vector<SuiteResult> read_baseline(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Failed to open baseline");
+    }
+
+    std::vector<SuiteResult> results;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.find("\"name\"") == std::string::npos) {
+            continue;
+        }
+        results.push_back({json_string(line, "name"), json_string(line, "mode"), json_number(line, "instructions_per_second"),
+            json_number(line, "ns_per_frame"), json_number(line, "display_ns_per_frame"),
+            static_cast<uint64_t>(json_number(line, "allocations"))});
+    }
+    return results;
+}
+
+// Keeps the better figure of two samples of one case, noise only ever makes a sample slower
+static void keep_best(SuiteResult& best, const SuiteResult& r) {
+    best.instructions_per_second = std::max(best.instructions_per_second, r.instructions_per_second);
+    best.ns_per_frame = std::min(best.ns_per_frame, r.ns_per_frame);
+    best.display_ns_per_frame = std::min(best.display_ns_per_frame, r.display_ns_per_frame);
+    best.allocations = std::max(best.allocations, r.allocations); // Not noise, every sample should allocate the same
+}
+
+static int run_suite(uint64_t budget, int samples, const std::string& output, const std::string& baseline_path, double tolerance) {
+    // Samples are taken in rounds over the whole suite rather than back to back, so a busy patch on the machine
+    // lasting a few seconds costs each case one sample instead of all of them
+    std::vector<SuiteRom> roms = suite_roms();
+    uint64_t sample_budget = std::max<uint64_t>(budget / samples, 1);
+    std::vector<SuiteResult> results;
+
+    for (int round = 0; round <= samples; ++round) { // Round 0 warms up decode tables, caches and clock speed and is dropped
+        size_t next = 0;
+        for (const SuiteRom& rom : roms) {
+            for (int mode : {Chip8::INTERPRETER, Chip8::BLOCK_CACHE, Chip8::JIT}) {
+                SuiteResult r = run_suite_rom(rom, mode, sample_budget);
+                if (round == 1) {
+                    results.push_back(r);
+                }
+                else if (round > 1) {
+                    keep_best(results[next], r);
+                }
+                ++next;
+            }
+        }
+    }
+
+    for (const SuiteResult& r : results) {
+        printf("%-8s %-12s %10.2f M instructions/s %10.2f ns/frame %8.2f display ns/frame %6llu allocations\n",
+            r.name.c_str(), r.mode.c_str(), r.instructions_per_second / 1e6, r.ns_per_frame, r.display_ns_per_frame,
+            static_cast<unsigned long long>(r.allocations));
+    }
+
+    if (!output.empty() && !write_json(output, budget, results)) {
+        fprintf(stderr, "%s: could not write results\n", output.c_str());
+        return 1;
+    }
+    if (baseline_path.empty()) {
+        return 0;
+    }
+
+    int regressions = 0;
+    for (const SuiteResult& base : read_baseline(baseline_path)) {
+        for (const SuiteResult& r : results) {
+            if (r.name != base.name || r.mode != base.mode) {
+                continue;
+            }
+            if (r.instructions_per_second < base.instructions_per_second * (1 - tolerance)) {
+                printf("REGRESSION %s %s: %.2f M instructions/s, baseline %.2f\n", r.name.c_str(), r.mode.c_str(),
+                    r.instructions_per_second / 1e6, base.instructions_per_second / 1e6);
+                ++regressions;
+            }
+            if (r.ns_per_frame > base.ns_per_frame * (1 + tolerance) && r.ns_per_frame > base.ns_per_frame + NOISE_FLOOR_NS) {
+                printf("REGRESSION %s %s: %.2f ns/frame, baseline %.2f\n", r.name.c_str(), r.mode.c_str(),
+                    r.ns_per_frame, base.ns_per_frame);
+                ++regressions;
+            }
+            if (r.allocations > base.allocations) {
+                printf("REGRESSION %s %s: %llu allocations, baseline %llu\n", r.name.c_str(), r.mode.c_str(),
+                    static_cast<unsigned long long>(r.allocations), static_cast<unsigned long long>(base.allocations));
+                ++regressions;
+            }
+        }
+    }
+
+    if (regressions) {
+        printf("%d regressions against %s\n", regressions, baseline_path.c_str());
+        return 3;
+    }
+    printf("No regressions against %s\n", baseline_path.c_str());
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int chip = Chip8::CHIP_8;
+    uint64_t budget = 0; // 50000000, 20000000 for the suite
+    int mode = Chip8::INTERPRETER;
+    bool differential = false;
+    std::string recording;
+    bool suite = false;
+    std::string output;
+    std::string baseline;
+    double tolerance = 0.25;
+    int samples = 5;
+    std::vector<std::string> roms;
+
+    try { // std::sto* throws on a number that does not parse
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "-c" && i + 1 < argc) {
+                chip = std::stoi(argv[++i]);
+            }
+            else if (arg == "-n" && i + 1 < argc) {
+                budget = std::stoull(argv[++i]);
+            }
+            else if (arg == "-m" && i + 1 < argc) {
+                if (!Chip8::parse_mode(argv[++i], mode)) {
+                    usage();
+                    return 1;
+                }
+            }
+            else if (arg == "-d") {
+                differential = true;
+            }
+            else if (arg == "-r" && i + 1 < argc) {
+                recording = argv[++i];
+            }
+            else if (arg == "-s") {
+                suite = true;
+            }
+            else if (arg == "-o" && i + 1 < argc) {
+                output = argv[++i];
+            }
+            else if (arg == "-b" && i + 1 < argc) {
+                baseline = argv[++i];
+            }
+            else if (arg == "-k" && i + 1 < argc) {
+                samples = std::stoi(argv[++i]);
+                if (samples < 1) {
+                    usage();
+                    return 1;
+                }
+            }
+            else if (arg == "-t" && i + 1 < argc) {
+                tolerance = std::stod(argv[++i]);
+            }
+            else if (!arg.empty() && arg[0] == '-') {
+                usage();
+                return 1;
+            }
+            else {
+                roms.push_back(arg);
+            }
+        }
+    }
+    catch (const std::exception&) {
+        usage();
+        return 1;
+    }
+
+    if (suite) {
+        try {
+            return run_suite(budget ? budget : 20000000, samples, output, baseline, tolerance);
+        }
+        catch (const std::exception& e) {
+            fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+    }
+    if (budget == 0) {
+        budget = 50000000;
+    }
+
+    if (roms.empty() || (chip < Chip8::CHIP_8 || chip > Chip8::SUPER_CHIP_LEGACY)) {
+        usage();
+        return 1;
+    }
+
+    if (!recording.empty()) {
+        if (roms.size() != 1) {
+            usage();
+            return 1;
+        }
+        try {
+            return replay(roms[0], recording, mode) ? 0 : 2;
+        }
+        catch (const std::exception& e) {
+            fprintf(stderr, "%s: %s\n", recording.c_str(), e.what());
+            return 1;
+        }
+    }
+
+    const int cycles_per_frame = Chip8::cycles_per_frame(chip);
+
+    if (differential) {
+        bool all_match = true;
+        for (const std::string& path : roms) {
+            try {
+                all_match &= lockstep(path, chip, mode, budget, cycles_per_frame + 1);
+            }
+            catch (const std::exception& e) {
+                fprintf(stderr, "%s: %s\n", path.c_str(), e.what());
+                return 1;
+            }
+        }
+        return all_match ? 0 : 2;
+    }
+
+    for (const std::string& path : roms) {
+        Chip8 emulator{chip};
+        try {
+            emulator.load_game(path);
+        }
+        catch (const std::exception& e) {
+            fprintf(stderr, "%s: %s\n", path.c_str(), e.what());
+            return 1;
+        }
+        emulator.set_mode(mode);
+
+        uint64_t executed = 0;
+        auto start = std::chrono::steady_clock::now();
+
+        while (executed < budget && emulator.is_running()) {
+            executed += emulator.run(cycles_per_frame);
+            emulator.tick_timers();
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double seconds = elapsed.count();
+
+        printf("%-40s %12llu instructions %9.3f s %10.2f M instructions/s\n", path.c_str(),
+            static_cast<unsigned long long>(executed), seconds, executed / seconds / 1e6);
+
+        std::string profile = std::filesystem::path(path).filename().string() + ".profile";
+        if (emulator.write_profile(profile)) { // Profiling builds only
+            printf("%-40s profile in %s.txt and %s.folded\n", "", profile.c_str(), profile.c_str());
+        }
+    }
+
+    return 0;
+}
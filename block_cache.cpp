@@ -0,0 +1,181 @@
+#include "chip8.h"
+#include <bit> // countr_zero
+
+// Straight-line runs of instructions are decoded once into blocks of micro-ops.
+// Blocks end at the first jump, skip, call, return, FX0A or store, so only the
+// last micro-op of a block can change PC. Stores that land on translated code
+// drop the blocks they overwrite. In JIT mode hot blocks also get native code,
+// see jit.cpp.
+
+static constexpr uint32_t MAX_BLOCK_LENGTH = 64;
+static constexpr size_t MAX_BLOCKS = 0xFFFF; // Indexes are stored as uint16_t
+static constexpr size_t MAX_BLOCK_OPS = 0x40000;
+static constexpr uint32_t JIT_THRESHOLD = 16; // Entries before a block is compiled
+static constexpr uint8_t VOLATILE_THRESHOLD = 32; // Dropped blocks before a page is left to the interpreter
+
+uint64_t Chip8::run(uint64_t cycles) {
+    uint64_t executed = 0;
+
+#ifdef CHIP8_PROFILE
+    if (true) { // Every instruction has to go through cycle() to be counted
+#else
+    if (mode == INTERPRETER) {
+#endif
+        while (executed < cycles && running) {
+            cycle();
+            ++executed;
+        }
+        return executed;
+    }
+
+    if (jit_code.copied) [[unlikely]] { // Copied from a machine whose native code this one must not run
+        recycle_blocks();
+    }
+
+    while (executed < cycles && running) {
+        // Instruction does not fit in memory (cycle() stops with PC_OUT_OF_RANGE) or keeps getting rewritten, leave it to the interpreter
+        if (PC >= 0x1000 - 1 || ((volatile_pages >> (PC >> 6)) & 1)) {
+            cycle();
+            ++executed;
+            continue;
+        }
+
+        uint16_t index = block_at[PC];
+        if (index == 0) {
+            index = translate(PC);
+        }
+
+        Block& block = blocks[index - 1];
+
+        if (mode == JIT) {
+            if (block.compiled_length == 0 && ++block.hits == JIT_THRESHOLD) {
+                jit_compile(block); // Can flush the cache, look the block up again
+                continue;
+            }
+            if (block.compiled_length != 0 && block.compiled_length <= cycles - executed) {
+                block.compiled(V);
+                executed += block.compiled_length;
+                continue;
+            }
+        }
+
+        const Opcode* ops = &block_ops[block.first];
+        uint64_t count = block.length;
+        if (count > cycles - executed) { // Stop mid-block so timing matches the interpreter
+            count = cycles - executed;
+        }
+
+        PC = block.start + 2 * count; // Only the last micro-op can read or change PC
+        for (uint64_t i = 0; i < count; ++i) {
+            ops[i].handler(*this, ops[i]);
+        }
+        executed += count;
+    }
+
+    return executed;
+}
+
+void Chip8::set_mode(int execution_mode) {
+    mode = execution_mode;
+    flush_blocks();
+}
+
+int Chip8::get_mode() {
+    return mode;
+}
+
+uint16_t Chip8::translate(uint16_t address) {
+    if (blocks.size() >= MAX_BLOCKS || block_ops.size() + MAX_BLOCK_LENGTH > MAX_BLOCK_OPS) {
+        recycle_blocks(); // Mostly invalidated blocks by now, start over
+    }
+
+    Block block;
+    block.start = address;
+    block.first = block_ops.size();
+    block.length = 0;
+    block.hits = 0;
+    block.compiled_length = 0;
+    block.compiled = nullptr;
+
+    while (address < 0x1000 - 1 && block.length < MAX_BLOCK_LENGTH) {
+        const Opcode& op = table[memory[address] << 8 | memory[address + 1]];
+        block_ops.push_back(op);
+        ++block.length;
+        address += 0x002;
+
+        if (op.ends_block) {
+            break;
+        }
+    }
+
+    block.end = address;
+    blocks.push_back(block);
+    block_at[block.start] = blocks.size();
+    block_starts[block.start >> 6] |= 1ULL << (block.start & 63);
+    code_pages |= page_mask(block.start, block.end - block.start);
+
+    return blocks.size();
+}
+
+void Chip8::invalidate_blocks(uint16_t address, int length) {
+    // Blocks span at most MAX_BLOCK_LENGTH instructions, so only starts this close can overlap.
+    // Pages keep their code_pages bit until the next flush.
+    int end = address + length;
+    int first = address - 2 * static_cast<int>(MAX_BLOCK_LENGTH) + 1;
+    if (first < 0) {
+        first = 0;
+    }
+    if (end > 0x1000) {
+        end = 0x1000;
+    }
+
+    for (int page = first >> 6; page <= (end - 1) >> 6; ++page) {
+        uint64_t starts = block_starts[page];
+        while (starts) {
+            int start = (page << 6) + std::countr_zero(starts);
+            starts &= starts - 1;
+
+            if (start < first || start >= end || address >= blocks[block_at[start] - 1].end) {
+                continue;
+            }
+
+            block_at[start] = 0; // Micro-ops stay allocated until the next flush
+            block_starts[page] &= ~(1ULL << (start & 63));
+
+            uint8_t& rewrites = page_rewrites[page];
+            if (rewrites < VOLATILE_THRESHOLD && ++rewrites == VOLATILE_THRESHOLD) {
+                volatile_pages |= 1ULL << page;
+            }
+        }
+    }
+}
+
+void Chip8::flush_blocks() {
+    recycle_blocks();
+    memset(page_rewrites, 0, sizeof(page_rewrites));
+    volatile_pages = 0;
+}
+
+void Chip8::recycle_blocks() {
+    blocks.clear();
+    block_ops.clear();
+    memset(block_at, 0, sizeof(block_at));
+    memset(block_starts, 0, sizeof(block_starts));
+    code_pages = 0;
+    jit_reset();
+    jit_code.copied = false;
+}
+
+uint64_t Chip8::page_mask(uint16_t address, int length) {
+    int first = address >> 6;
+    int last = (address + length - 1) >> 6;
+    if (first > 63) {
+        return 0;
+    }
+    if (last > 63) {
+        last = 63;
+    }
+
+    uint64_t upto_last = (last == 63) ? ~0ULL : (1ULL << (last + 1)) - 1;
+    return upto_last & ~((1ULL << first) - 1);
+}
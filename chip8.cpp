@@ -1,999 +1,690 @@
 #include "chip8.h"
+#include "quirks.h"
+#include <mutex>
+#include <algorithm> // std::min
+#include <bit> // std::rotl, std::countr_zero
+#include <cstddef> // offsetof
 
 void Chip8::cycle() {
-    // Infinite loop of fetch, decode, execute
+    // Fetch, then a single indirect dispatch through the decode table
+    if (PC > 0x1000 - 2) [[unlikely]] { // Both bytes have to be in memory, every engine ends up here for such a PC
+        fault = PC_OUT_OF_RANGE;
+        running = false;
+        return;
+    }
     uint16_t instruction = memory[PC] << 8 | memory[PC + 0x001];
     PC += 0x002;
 
-    switch (instruction >> 12) {
-        case 0x0: {
-            switch (instruction & 0xFF) {
-                case 0xE0: { // Clear screen                         
-                    memset(screen, 0, sizeof(screen));
-                    memset(screen_super, 0, sizeof(screen_super)); // SUPER_CHIP high resolution screen
-                    display_changed = 1;                                        
-                    break;
-                }
-                case 0xEE: { // Returning from subroutine
-                    PC = stack.top();
-                    stack.pop();
-                    break;
-                }
-
-                // SUPER_CHIP specific instructions
-                case 0xFB: { // Scroll right
-                    pixels_horizontal -= 4;
-                    break;
-                }
-
-                case 0xFC: { // Scroll left
-                    pixels_horizontal += 4;
-                    break;
-                }
-
-                case 0xFD: {
-                    running = false;
-                    break;
-                }
-
-                case 0xFE: {
-                    high_res = false;
-                    break;
-                }
-
-                case 0xFF: {
-                    high_res = true;
-                    break;
-                }
+    const Opcode& op = table[instruction];
+#ifdef CHIP8_PROFILE
+    uint16_t address = PC - 0x002;
+    uint8_t depth = sp;
+    profiler.begin();
+    op.handler(*this, op);
+    profiler.end(address, instruction, sp - depth, PC); // After a call PC is the routine entered
+#else
+    op.handler(*this, op);
+#endif
+}
 
-                default:
-                    break;
-            }
+template <int Chip, int Quirks, bool HighRes>
+Chip8::Opcode Chip8::decode(uint16_t instruction) {
+    // Maps one instruction to its handler, operands are extracted here once instead of every cycle
+    Opcode op;
+    op.handler = &handler<&Chip8::op_nop>; // Unknown instructions do nothing
+    op.nnn = instruction & 0xFFF;
+    op.x = (instruction >> 8) & 0xF;
+    op.y = (instruction >> 4) & 0xF;
+    op.n = instruction & 0xF;
+    op.nn = instruction & 0xFF;
 
-            switch ((instruction >> 4) & 0xF) {
-                case 0xC: { // Scroll down
-                    pixels_vertical -= instruction & 0xF;
+    switch (instruction >> 12) {
+        case 0x0: {
+            switch (op.nn) {
+                case 0xE0: op.handler = &handler<&Chip8::op_00E0>; break;
+                case 0xEE: op.handler = &handler<&Chip8::op_00EE>; break;
+                case 0xFB: if (Chip != CHIP_8) op.handler = &handler<&Chip8::op_00FB>; break;
+                case 0xFC: if (Chip != CHIP_8) op.handler = &handler<&Chip8::op_00FC>; break;
+                case 0xFD: op.handler = &handler<&Chip8::op_00FD>; break;
+                case 0xFE: op.handler = &handler<&Chip8::op_00FE>; break;
+                case 0xFF: op.handler = &handler<&Chip8::op_00FF>; break;
+                default: {
+                    if (Chip != CHIP_8 && op.y == 0xC) { // Scrolling only exists on SUPER_CHIP
+                        op.handler = &handler<&Chip8::op_00CN>;
+                    }
                     break;
                 }
-
-                default:
-                    break;
-
             }
             break;
         }
-                    
-        case 0x1: { // Jump
-            PC = instruction & 0xFFF;
-            break;
-        }
 
-        case 0x2: { // Call subroutine
-            stack.push(PC);
-            PC = instruction & 0xFFF;
-            break;
-        }
-        
-        // Jump conditionally
-        case 0x3: {
-            if (V[(instruction >> 8) & 0xF] == (instruction & 0xFF)) {
-                PC += 0x002;
+        case 0x1: op.handler = &handler<&Chip8::op_1NNN>; break;
+        case 0x2: op.handler = &handler<&Chip8::op_2NNN>; break;
+        case 0x3: op.handler = &handler<&Chip8::op_3XNN>; break;
+        case 0x4: op.handler = &handler<&Chip8::op_4XNN>; break;
+        case 0x5: op.handler = &handler<&Chip8::op_5XY0>; break;
+        case 0x6: op.handler = &handler<&Chip8::op_6XNN>; break;
+        case 0x7: op.handler = &handler<&Chip8::op_7XNN>; break;
+
+        case 0x8: {
+            switch (op.n) {
+                case 0x0: op.handler = &handler<&Chip8::op_8XY0>; break;
+                case 0x1: op.handler = &handler<&Chip8::op_8XY1<Quirks>>; break;
+                case 0x2: op.handler = &handler<&Chip8::op_8XY2<Quirks>>; break;
+                case 0x3: op.handler = &handler<&Chip8::op_8XY3<Quirks>>; break;
+                case 0x4: op.handler = &handler<&Chip8::op_8XY4>; break;
+                case 0x5: op.handler = &handler<&Chip8::op_8XY5>; break;
+                case 0x6: op.handler = &handler<&Chip8::op_8XY6<Quirks>>; break;
+                case 0x7: op.handler = &handler<&Chip8::op_8XY7>; break;
+                case 0xE: op.handler = &handler<&Chip8::op_8XYE<Quirks>>; break;
+                default: break;
             }
             break;
         }
 
-        case 0x4: {
-            if (V[(instruction >> 8) & 0xF] != (instruction & 0xFF)) {
-                PC += 0x002;
+        case 0x9: op.handler = &handler<&Chip8::op_9XY0>; break;
+        case 0xA: op.handler = &handler<&Chip8::op_ANNN>; break;
+        case 0xB: op.handler = &handler<&Chip8::op_BNNN<Quirks>>; break;
+        case 0xC: op.handler = &handler<&Chip8::op_CXNN>; break;
+        case 0xD: {
+            if (HighRes && op.n == 0) {
+                op.handler = &handler<&Chip8::op_DXYN<Chip, HighRes, true>>;
             }
-            break;
-        }
-
-        case 0x5: {
-            if (V[(instruction >> 8) & 0xF] == V[(instruction >> 4) & 0xF]) {
-                PC += 0x002;
+            else {
+                op.handler = &handler<&Chip8::op_DXYN<Chip, HighRes, false>>;
             }
             break;
         }
 
-        case 0x6: { // Set
-            V[(instruction >> 8) & 0xF] = instruction & 0xFF;
-            break;
-        }
-
-        case 0x7: { // Addition
-            V[(instruction >> 8) & 0xF] += instruction & 0xFF;
+        case 0xE: {
+            switch (op.n) {
+                case 0x1: op.handler = &handler<&Chip8::op_EXA1>; break;
+                case 0xE: op.handler = &handler<&Chip8::op_EX9E>; break;
+                default: break;
+            }
             break;
         }
 
-        case 0x8: { // Logic and Arithmetic
-            int x = (instruction >> 8) & 0xF;
-            int y = (instruction >> 4) & 0xF;
-
-            switch (instruction & 0xF) {
-                case 0x0: {
-                    V[x] = V[y];
-                    break;
-                }
-
-                case 0x1: {
-                    V[x] |= V[y];
-                    switch(chip) {
-                        case CHIP_8: {
-                            V[15] = 0;
-                            break;
-                        }
-                        default:
-                            break;
-                    }
-                    
-                    break;
-                }
-
-                case 0x2: {
-                    V[x] &= V[y];
-                    switch(chip) {
-                        case CHIP_8: {
-                            V[15] = 0;
-                            break;
-                        }
-                        default:
-                            break;
-                    }
-                    break;
-                }
-
-                case 0x3: {
-                    V[x] ^= V[y];
-                    switch(chip) {
-                        case CHIP_8: {
-                            V[15] = 0;
-                            break;
-                        }
-                        default:
-                            break;
+        case 0xF: {
+            switch (op.n) {
+                case 0x0: op.handler = &handler<&Chip8::op_FX30>; break;
+                case 0x3: op.handler = &handler<&Chip8::op_FX33>; break;
+                case 0x5: {
+                    switch (op.y) {
+                        case 0x1: op.handler = &handler<&Chip8::op_FX15>; break;
+                        case 0x5: op.handler = &handler<&Chip8::op_FX55<Quirks>>; break;
+                        case 0x6: op.handler = &handler<&Chip8::op_FX65<Quirks>>; break;
+                        case 0x7: op.handler = &handler<&Chip8::op_FX75>; break;
+                        case 0x8: op.handler = &handler<&Chip8::op_FX85>; break;
+                        default: break;
                     }
                     break;
                 }
+                case 0x7: op.handler = &handler<&Chip8::op_FX07>; break;
+                case 0x8: op.handler = &handler<&Chip8::op_FX18>; break;
+                case 0x9: op.handler = &handler<&Chip8::op_FX29>; break;
+                case 0xA: op.handler = &handler<&Chip8::op_FX0A>; break;
+                case 0xE: op.handler = &handler<&Chip8::op_FX1E>; break;
+                default: break;
+            }
+            break;
+        }
 
-                case 0x4: { // Addition with possible overflow
-                    int Vx = V[x];
-                    int Vy = V[y];
-
-                    V[x] += V[y];
-
-                    if (Vx+Vy > 255) {
-                        V[15] = 1;
-                    }
-                    else {
-                        V[15] = 0;
-                    }
-
-                    break;
-                }
+        default:
+            break;
+    }
 
-                case 0x5: { // Subtraction with possible underflow
-                    int Vx = V[x];
-                    int Vy = V[y];
+    // Control flow and stores into memory end a translated block
+    switch (instruction >> 12) {
+        case 0x0: op.ends_block = (op.nn == 0xEE || op.nn >= 0xFD); break; // 00FE/00FF switch tables
+        case 0x1: case 0x2: case 0x3: case 0x4: case 0x5: case 0x9: case 0xB: case 0xE: op.ends_block = true; break;
+        case 0xF: op.ends_block = (op.n == 0xA || op.n == 0x3 || (op.n == 0x5 && op.y == 0x5)); break;
+        default: op.ends_block = false; break;
+    }
 
-                    V[x] -= V[y];
+    return op;
+}
 
-                    if (Vx-Vy >= 0) {
-                        V[15] = 1;
-                    }
-                    else {
-                        V[15] = 0;
-                    }
+template <int Chip, int Quirks, bool HighRes>
+std::vector<Chip8::Opcode> Chip8::build_table() {
+    std::vector<Chip8::Opcode> built(0x10000);
+    for (int instruction = 0; instruction < 0x10000; ++instruction) {
+        built[instruction] = decode<Chip, Quirks, HighRes>(instruction);
+    }
+    return built;
+}
 
-                    break;
-                }
+template <int Chip, bool HighRes, int... Quirks>
+std::vector<Chip8::Opcode> Chip8::build_table(int quirks, std::integer_sequence<int, Quirks...>) {
+    // One instantiation per quirk set, picked by index
+    using Builder = std::vector<Opcode> (*)();
+    static constexpr Builder builders[] = {&build_table<Chip, Quirks, HighRes>...};
+    return builders[quirks]();
+}
 
-                case 0x6: { // Shift
-                    switch (chip) {
-                        case CHIP_8: {
-                            uint8_t holder = V[y] & 0x1;
-                            V[x] = V[y] >> 1;
-                            V[15] = holder;
-                            break;
-                        }
-                        
-                        case SUPER_CHIP: { 
-                            uint8_t holder = V[x] & 0x1;
-                            V[x] = V[x] >> 1;
-                            V[15] = holder;
-                            break;
-                        }
+const Chip8::Opcode* Chip8::decode_table(int type, int quirks, bool high_res) {
+    // Built once per chip type, quirk set and resolution on first use, shared by every instance
+    static std::mutex lock; // Emulators are created on several threads by chip8-batch
+    static std::vector<Opcode> tables[VARIANTS][QUIRK_SETS][2];
+    static constexpr auto sets = std::make_integer_sequence<int, QUIRK_SETS>();
+
+    high_res = high_res && type != CHIP_8; // CHIP_8 draws the same either way
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<Opcode>& built = tables[type - 1][quirks][high_res];
+    if (built.empty()) {
+        switch (type) {
+            case CHIP_8: built = build_table<CHIP_8, false>(quirks, sets); break;
+            case SUPER_CHIP: built = high_res ? build_table<SUPER_CHIP, true>(quirks, sets) : build_table<SUPER_CHIP, false>(quirks, sets); break;
+            default: built = high_res ? build_table<SUPER_CHIP_LEGACY, true>(quirks, sets) : build_table<SUPER_CHIP_LEGACY, false>(quirks, sets); break;
+        }
+    }
+    return built.data();
+}
 
-                    }
-                    break;
-                }
+void Chip8::load_tables() {
+    lores_table = decode_table(chip, quirks, false);
+    hires_table = decode_table(chip, quirks, true);
+    table = high_res ? hires_table : lores_table;
+}
 
-                case 0x7: { // Subtraction with possible underflow
-                    int Vx = V[x];
-                    int Vy = V[y];
+void Chip8::select_table() {
+    const Opcode* wanted = high_res ? hires_table : lores_table;
+    if (wanted != table) {
+        table = wanted;
+        recycle_blocks(); // Cached micro-ops hold the other resolution's DXYN. 00FE/00FF end blocks, so none is running
+    }
+}
 
-                    V[x] = V[y] - V[x];
+// --- Instruction handlers ---
 
-                    if (Vy-Vx >= 0) {
-                        V[15] = 1;
-                    }
-                    else {
-                        V[15] = 0;
-                    }
+void Chip8::op_nop(const Opcode&) {
+}
 
-                    break;
-                }
+void Chip8::op_00E0(const Opcode&) { // Clear screen
+    memset(screen, 0, sizeof(screen));
+    memset(screen_super, 0, sizeof(screen_super)); // SUPER_CHIP high resolution screen
+    display_changed = 1;
+    dirty_rows = ALL_ROWS;
+}
 
-                case 0xE: {
-                    switch (chip) {
-                        case CHIP_8: {
-                            uint8_t holder = (V[y] & 0x80) >> 7;
-                            V[x] = V[y] << 1;
-                            V[15] = holder;
-                            break;
-                        }
-
-                        case SUPER_CHIP: {   
-                            uint8_t holder = (V[x] & 0x80) >> 7;
-                            V[x] = V[x] << 1;
-                            V[15] = holder;
-                            break;
-                        }
-                        
-                    }
-                    break;
-                }
-                default:
-                    break;
-            }
-            break;
-        }
-            
+void Chip8::op_00EE(const Opcode&) { // Returning from subroutine
+    if (sp == 0) {
+        stop(STACK_UNDERFLOW);
+        return;
+    }
+    PC = stack[--sp];
+}
 
-        // Last jump conditionally
-        case 0x9: {
-            if (V[(instruction >> 8) & 0xF] != V[(instruction >> 4) & 0xF]) {
-                PC += 0x002;
-            }
-            break;
-        }
+// SUPER_CHIP specific instructions
+// Scrolling moves the active area, 128x64 or the top left 64x32 in low resolution
+void Chip8::op_00CN(const Opcode& op) { // Scroll down
+    int height = high_res ? 64 : 32;
+    int n = (op.n < height) ? op.n : height;
 
-        case 0xA: { // Set index
-            I = instruction & 0xFFF;
-            break;
-        }
+    memmove(screen_super[n], screen_super[0], (height - n) * sizeof(screen_super[0]));
+    memset(screen_super[0], 0, n * sizeof(screen_super[0]));
+    display_changed = 1;
+    dirty_rows = ALL_ROWS;
+}
 
-        case 0xB: { // Jump with offset
-            switch (chip) {
-                case CHIP_8: {
-                    PC = (instruction & 0xFFF) + V[0];
-                    break;
-                }
-                
-                case SUPER_CHIP: {   
-                    PC = (instruction & 0xFFF) + V[(instruction >> 8) & 0xF];
-                    break;
-                }
-            }
-            break;
+void Chip8::op_00FB(const Opcode&) { // Scroll right
+    int height = high_res ? 64 : 32;
+    for (int y = 0; y < height; ++y) {
+        uint64_t* line = screen_super[y];
+        if (high_res) {
+            line[1] = (line[1] >> 4) | (line[0] << 60);
         }
+        line[0] >>= 4;
+    }
+    display_changed = 1;
+    dirty_rows = ALL_ROWS;
+}
 
-        case 0xC: { // Random number 
-            std::random_device rd; // Seeding random number generator
-            std::mt19937 mt(rd());
-            std::uniform_int_distribution<uint8_t> dist(0, 255); // Define distribution
-
-            V[(instruction >> 8) & 0xF] = dist(mt) & (instruction & 0xFF);
-            break;
+void Chip8::op_00FC(const Opcode&) { // Scroll left
+    int height = high_res ? 64 : 32;
+    for (int y = 0; y < height; ++y) {
+        uint64_t* line = screen_super[y];
+        if (high_res) {
+            line[0] = (line[0] << 4) | (line[1] >> 60);
+            line[1] <<= 4;
         }
-
-        case 0xD: { // Display
-            switch (chip) {
-                case CHIP_8: {
-                    int width = 63;
-                    int height = 31;
-
-                    uint8_t X0 = V[(instruction >> 8) & 0xF] & width; // AND 63 is the same as modulo
-                    uint8_t Y = V[(instruction >> 4) & 0xF] & height;
-                    uint8_t rows;
-                    V[15] = 0;
-                    uint8_t data;
-                    uint8_t X;
-                    uint8_t bit_value;
-                    display_changed = 1;
-
-                    for (rows = 0; rows < (instruction & 0xF); ++rows) {
-                        data = memory[I + rows];
-                        X = X0;
-
-                        for (int i = 0; i < 8; ++i) {
-                            bit_value = (data >> (7 - i)) & 1;
-
-                            if (bit_value && screen[X][Y]) { // Both 1, turn off and set flag
-                                screen[X][Y] = 0;
-                                V[15] = 1;                               
-                            }
-                            else if (bit_value && !screen[X][Y]) { // Screen off, turn on
-                                screen[X][Y] = 1;
-                            }
-
-                            if (X == (width + 1)) { // Reached edge of screen
-                                continue;
-                            }
-                            ++X;
-                        }
-                        
-                        if (Y == (height + 1)) { // Reached bottom of screen
-                            continue;
-                        }
-                        ++Y;
-                    
-                    }
-                    break;
-                }
-            
-                case SUPER_CHIP: {   
-                    
-                    int width = high_res ? 127 : 63; // High res on/off
-                    int height = high_res ? 63 : 31; // High res on/off
-
-                    int display_type = instruction & 0xF;
-                    int rows = (high_res && (display_type == 0)) ? 16 : display_type; // DXY0 or DXYN
-                    int bytes_per_row = (rows == 16) ? 2 : 1; // Specific needed for super sprite
-
-                    uint8_t X = V[(instruction >> 8) & 0xF] & width; // AND 63 is the same as modulo
-                    uint8_t Y = V[(instruction >> 4) & 0xF] & height;
-                    V[15] = 0;
-                    uint8_t data;
-                    int x;
-                    int y;
-                    uint8_t bit_value;
-
-                    for (int j = 0; j < rows; ++j) {
-                        for (int byte = 0; byte < bytes_per_row; ++byte) {
-                            data = memory[I + j + byte*8];
-                            y = Y + pixels_vertical + j;
-
-                            // Skip rows that are off-screen
-                            if (y < 0 || y > height) {
-                                continue;
-                            }
-
-                            for (int i = 0; i < 8; ++i) {
-                                bit_value = (data >> (7 - i)) & 1;
-                                x = X + pixels_horizontal + byte*8 + i;
-
-                                // Skip columns that are off-screen
-                                if (x < 0 || x > width) {
-                                    continue;
-                                }
-                               
-                                if (bit_value && screen_super[x][y]) {
-                                    screen_super[x][y] = 0;
-                                    V[15] = 1;
-                                    display_changed = 1;
-                                }
-                                else if (bit_value && !screen_super[x][y]) {
-                                    screen_super[x][y] = 1;
-                                    display_changed = 1;
-                                }
-                                
-                            }
-
-                        }
-                    }
-                        
-                    break;
-                            
-                }
-                
-            }   
-            break; 
+        else {
+            line[0] <<= 4;
         }
+    }
+    display_changed = 1;
+    dirty_rows = ALL_ROWS;
+}
 
-        case 0xE: { // Skip if
-            switch (instruction & 0xF) {
-                case 0x1: {
-                    uint8_t Vx = V[(instruction >> 8) & 0xF];
-                    if (!keypad[Vx]) {
-                        PC += 0x002;
-                    }
-                    break;
-                }
-                    
-                case 0xE: {
-                    uint8_t Vx = V[(instruction >> 8) & 0xF];
-                    if (keypad[Vx]) {
-                        PC += 0x002;
-                    }
-                    break;
-                }
+void Chip8::op_00FD(const Opcode&) {
+    running = false;
+}
 
-                default:
-                    break;
+void Chip8::op_00FE(const Opcode&) {
+    high_res = false;
+    select_table();
+    display_changed = 1; // Resolution switch
+    dirty_rows = ALL_ROWS;
+}
 
-            }
-            break;
-        }
+void Chip8::op_00FF(const Opcode&) {
+    high_res = true;
+    select_table();
+    display_changed = 1;
+    dirty_rows = ALL_ROWS;
+}
 
-        case 0xF: {
-            switch(instruction & 0xF) {
-                case 0x0: { // Set I to big hex location
-                    uint8_t value = V[(instruction >> 8) & 0xF] & 0xF;
-                    switch(value) {
-                        case 0x0: {
-                            I = 0x0A0;
-                            break;
-                        }
-
-                        case 0x1: {
-                            I = 0x0AA;
-                            break;
-                        }
-
-                        case 0x2: {
-                            I = 0x0B4;
-                            break;
-                        }
-
-                        case 0x3: {
-                            I = 0x0BE;
-                            break;
-                        }
-
-                        case 0x4: {
-                            I = 0x0C8;
-                            break;
-                        }
-
-                        case 0x5: {
-                            I = 0x0D2;
-                            break;
-                        }
-
-                        case 0x6: {
-                            I = 0x0DC;
-                            break;
-                        }
-
-                        case 0x7: {
-                            I = 0x0E6;
-                            break;
-                        }
-
-                        case 0x8: {
-                            I = 0x0F0;
-                            break;
-                        }
-
-                        case 0x9: {
-                            I = 0x0FA;
-                            break;
-                        }
-
-                        case 0xA: {
-                            I = 0x104;
-                            break;
-                        }
-
-                        case 0xB: {
-                            I = 0x10E;
-                            break;
-                        }
-
-                        case 0xC: {
-                            I = 0x118;
-                            break;
-                        }
-
-                        case 0xD: {
-                            I = 0x122;
-                            break;
-                        }
-
-                        case 0xE: {
-                            I = 0x12C;
-                            break;
-                        }
-
-                        case 0xF: {
-                            I = 0x136;
-                            break;
-                        }
-
-                        default:
-                            break;
-                    }
-                    break;
-                }
-                    
-                case 0x3: { // Binary coded decimal conversion
-                    int Vx = V[(instruction >> 8) & 0xF];
-                    memory[I] = Vx / 100;
-                    memory[I+1] = (Vx % 100) / 10;
-                    memory[I+2] = Vx % 10;
-                    break;
-                }
+void Chip8::op_1NNN(const Opcode& op) { // Jump
+    PC = op.nnn;
+}
 
-                case 0x5: {
-                    switch ((instruction >> 4) & 0xF) {
-                        case 0x1: { // Set delay timer
-                            delay_countdown = V[(instruction >> 8) & 0xF];
-                            break;
-                        }
-
-                        case 0x5: { // Store into memory
-                            switch(chip) {
-                                case CHIP_8: {
-                                    uint8_t x = (instruction >> 8) & 0xF;
-                                    for (int i = 0; i < x + 1; ++ i) {
-                                        memory[I] = V[i];
-                                        ++I;
-                                    }
-                                    break;
-                                }
-
-                                case SUPER_CHIP: {   
-                                    uint8_t x = (instruction >> 8) & 0xF;
-                                    for (int i = 0; i < x + 1; ++ i) {
-                                        memory[I+i] = V[i];
-                                    }
-                                    break;
-                                }
-                            }
-                            break;
-                        }
-
-                        case 0x6: { // Load from memory
-                            switch(chip) {
-                                case CHIP_8: {
-                                    uint8_t x = (instruction >> 8) & 0xF;
-                                    for (int i = 0; i < x + 1; ++ i) {
-                                        V[i] = memory[I];
-                                        ++I;
-                                    }
-                                    break;
-                                }
-
-                                case SUPER_CHIP: {   
-                                    uint8_t x = (instruction >> 8) & 0xF;
-                                    for (int i = 0; i < x + 1; ++ i) {
-                                        V[i] = memory[I+i];
-                                    }
-                                    break;
-                                }
-                            }
-                            break;
-                        }
-
-                        case 0x7: { // Save to flag registers
-                            int count = (instruction >> 8) & 0xF;
-                            if (count > 15) {
-                                count = 15;
-                            }
-                            for (int i = 0; i <= count; ++i) {
-                                flag[i] = V[i];
-                            }
-                            break;
-                        }
-
-                        case 0x8: { // Restore from flag registers
-                            int count = (instruction >> 8) & 0xF;
-                            if (count > 15) {
-                                count = 15;
-                            }
-                            for (int i = 0; i <= count; ++i) {
-                                V[i] = flag[i];
-                            }
-                            break;
-                        }
-
-                        default:
-                            break;
+void Chip8::op_2NNN(const Opcode& op) { // Call subroutine
+    if (sp == 16) {
+        stop(STACK_OVERFLOW);
+        return;
+    }
+    stack[sp++] = PC;
+    PC = op.nnn;
+}
 
-                    }
-                    break;
-                }
+// Jump conditionally
+void Chip8::op_3XNN(const Opcode& op) {
+    if (V[op.x] == op.nn) {
+        PC += 0x002;
+    }
+}
 
-                case 0x7: { // Read delay timer
-                    V[(instruction >> 8) & 0xF] = delay_countdown;
-                    break;
-                }
+void Chip8::op_4XNN(const Opcode& op) {
+    if (V[op.x] != op.nn) {
+        PC += 0x002;
+    }
+}
 
-                case 0x8: { // Set sound timer
-                    sound_countdown = V[(instruction >> 8) & 0xF];
-                    break;
-                }
+void Chip8::op_5XY0(const Opcode& op) {
+    if (V[op.x] == V[op.y]) {
+        PC += 0x002;
+    }
+}
 
-                case 0x9: { // Set I to font location
-                    uint8_t value = V[(instruction >> 8) & 0xF] & 0xF;
-                    switch(value) {
-                        case 0x0: {
-                            I = 0x050;
-                            break;
-                        }
-
-                        case 0x1: {
-                            I = 0x055;
-                            break;
-                        }
-
-                        case 0x2: {
-                            I = 0x05A;
-                            break;
-                        }
-
-                        case 0x3: {
-                            I = 0x05F;
-                            break;
-                        }
-
-                        case 0x4: {
-                            I = 0x064;
-                            break;
-                        }
-
-                        case 0x5: {
-                            I = 0x069;
-                            break;
-                        }
-
-                        case 0x6: {
-                            I = 0x06E;
-                            break;
-                        }
-
-                        case 0x7: {
-                            I = 0x073;
-                            break;
-                        }
-
-                        case 0x8: {
-                            I = 0x078;
-                            break;
-                        }
-
-                        case 0x9: {
-                            I = 0x07D;
-                            break;
-                        }
-
-                        case 0xA: {
-                            I = 0x082;
-                            break;
-                        }
-
-                        case 0xB: {
-                            I = 0x087;
-                            break;
-                        }
-
-                        case 0xC: {
-                            I = 0x08C;
-                            break;
-                        }
-
-                        case 0xD: {
-                            I = 0x091;
-                            break;
-                        }
-
-                        case 0xE: {
-                            I = 0x096;
-                            break;
-                        }
-
-                        case 0xF: {
-                            I = 0x09A;
-                            break;
-                        }
-
-                        default:
-                            break;
-                    }
-                    break;
-                }
+void Chip8::op_6XNN(const Opcode& op) { // Set
+    V[op.x] = op.nn;
+}
 
-                case 0xE: { // Add index and set flag
-                    uint8_t x = (instruction >> 8) & 0xF;
-                    int Vx = V[x];
+void Chip8::op_7XNN(const Opcode& op) { // Addition
+    V[op.x] += op.nn;
+}
 
-                    I += V[x];
+// Logic and Arithmetic
+void Chip8::op_8XY0(const Opcode& op) {
+    V[op.x] = V[op.y];
+}
 
-                    if (Vx+I > 255) {
-                        V[15] = 1;
-                    }
-                    else {
-                        V[15] = 0;
-                    }
+template <int Quirks>
+void Chip8::op_8XY1(const Opcode& op) {
+    V[op.x] |= V[op.y];
+    if constexpr (Quirks & VF_RESET) {
+        V[15] = 0;
+    }
+}
 
-                    break;
-                }   
+template <int Quirks>
+void Chip8::op_8XY2(const Opcode& op) {
+    V[op.x] &= V[op.y];
+    if constexpr (Quirks & VF_RESET) {
+        V[15] = 0;
+    }
+}
 
-                case 0xA: { // Get key
-                    if (!running) {
-                        break;
-                    }
-                    
-                    if (key && !keypad[index]) {
-                        V[(instruction >> 8) & 0xF] = index;
-                        key = false;
-                        break;
-                    }
-                    index = 0;
-                    for (int i = 0; i < 16; ++i) {
-                        if (keypad[i]) {
-                            key = true;
-                            break;
-                        }
-                        index += 1;
-                    }
+template <int Quirks>
+void Chip8::op_8XY3(const Opcode& op) {
+    V[op.x] ^= V[op.y];
+    if constexpr (Quirks & VF_RESET) {
+        V[15] = 0;
+    }
+}
 
-                    PC -= 0x002;
-                  
-                    break;
-                }
+void Chip8::op_8XY4(const Opcode& op) { // Addition with possible overflow
+    int Vx = V[op.x];
+    int Vy = V[op.y];
 
-                default:
-                    break;
-            }
-        }
+    V[op.x] += V[op.y];
 
-        default: {
-            break;
-        }
+    if (Vx+Vy > 255) {
+        V[15] = 1;
+    }
+    else {
+        V[15] = 0;
     }
-    
 }
 
-bool Chip8::poll(SDL_Event event) {
-    // Reads inputs from 1234 down to ZXCV
-    bool running = true;
+void Chip8::op_8XY5(const Opcode& op) { // Subtraction with possible underflow
+    int Vx = V[op.x];
+    int Vy = V[op.y];
 
-    while (SDL_PollEvent(&event)) {
-        if (!running) {
-            break;
-        }
+    V[op.x] -= V[op.y];
 
-        switch(event.type) {
-            case SDL_QUIT: {
-                running = false;
-                break;
-            }
+    if (Vx-Vy >= 0) {
+        V[15] = 1;
+    }
+    else {
+        V[15] = 0;
+    }
+}
 
-            case SDL_KEYDOWN: {
-                switch(event.key.keysym.scancode) {
-                    case SDL_SCANCODE_1: { // 1
-                        keypad[1] = 1;
-                        break;
-                    }
+template <int Quirks>
+void Chip8::op_8XY6(const Opcode& op) { // Shift
+    if constexpr (Quirks & SHIFT_VY) {
+        uint8_t holder = V[op.y] & 0x1;
+        V[op.x] = V[op.y] >> 1;
+        V[15] = holder;
+    }
+    else {
+        uint8_t holder = V[op.x] & 0x1;
+        V[op.x] = V[op.x] >> 1;
+        V[15] = holder;
+    }
+}
 
-                    case SDL_SCANCODE_2: { // 2
-                        keypad[2] = 1;
-                        break;
-                    }
+void Chip8::op_8XY7(const Opcode& op) { // Subtraction with possible underflow
+    int Vx = V[op.x];
+    int Vy = V[op.y];
 
-                    case SDL_SCANCODE_3: { // 3
-                        keypad[3] = 1;
-                        break;
-                    }
+    V[op.x] = V[op.y] - V[op.x];
 
-                    case SDL_SCANCODE_4: { // C
-                        keypad[12] = 1;
-                        break;
-                    }
+    if (Vy-Vx >= 0) {
+        V[15] = 1;
+    }
+    else {
+        V[15] = 0;
+    }
+}
 
-                    case SDL_SCANCODE_Q: { // 4
-                        keypad[4] = 1;
-                        break;
-                    }
+template <int Quirks>
+void Chip8::op_8XYE(const Opcode& op) {
+    if constexpr (Quirks & SHIFT_VY) {
+        uint8_t holder = (V[op.y] & 0x80) >> 7;
+        V[op.x] = V[op.y] << 1;
+        V[15] = holder;
+    }
+    else {
+        uint8_t holder = (V[op.x] & 0x80) >> 7;
+        V[op.x] = V[op.x] << 1;
+        V[15] = holder;
+    }
+}
 
-                    case SDL_SCANCODE_W: { // 5
-                        keypad[5] = 1;
-                        break;
-                    }
+// Last jump conditionally
+void Chip8::op_9XY0(const Opcode& op) {
+    if (V[op.x] != V[op.y]) {
+        PC += 0x002;
+    }
+}
 
-                    case SDL_SCANCODE_E: { // 6
-                        keypad[6] = 1;
-                        break;
-                    }
+void Chip8::op_ANNN(const Opcode& op) { // Set index
+    I = op.nnn;
+}
 
-                    case SDL_SCANCODE_R: { // D
-                        keypad[13] = 1;
-                        break;
-                    }
+template <int Quirks>
+void Chip8::op_BNNN(const Opcode& op) { // Jump with offset
+    if constexpr (Quirks & JUMP_VX) {
+        PC = op.nnn + V[op.x];
+    }
+    else {
+        PC = op.nnn + V[0];
+    }
+}
 
-                    case SDL_SCANCODE_A: { // 7
-                        keypad[7] = 1;
-                        break;
-                    }
+void Chip8::op_CXNN(const Opcode& op) { // Random number
+    V[op.x] = random_byte() & op.nn;
+}
 
-                    case SDL_SCANCODE_S: { // 8
-                        keypad[8] = 1;
-                        break;
-                    }
+void Chip8::set_seed(uint64_t value) {
+    seed = value;
+    seed_rng();
+}
 
-                    case SDL_SCANCODE_D: { // 9
-                        keypad[9] = 1;
-                        break;
-                    }
+uint64_t Chip8::get_seed() {
+    return seed;
+}
 
-                    case SDL_SCANCODE_F: { // E
-                        keypad[14] = 1;
-                        break;
-                    }
+void Chip8::seed_rng() {
+    uint64_t s = seed;
+    for (uint64_t& word : rng) { // splitmix64, never leaves the state all zero
+        s += 0x9E3779B97F4A7C15;
+        uint64_t z = s;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+        word = z ^ (z >> 31);
+    }
+}
 
-                    case SDL_SCANCODE_Z: { // A
-                        keypad[10] = 1;
-                        break;
-                    }
+uint8_t Chip8::random_byte() {
+    // xoshiro256**, the top bits are the strongest
+    uint64_t result = std::rotl(rng[1] * 5, 7) * 9;
+    uint64_t t = rng[1] << 17;
 
-                    case SDL_SCANCODE_X: { // 0
-                        keypad[0] = 1;
-                        break;
-                    }
+    rng[2] ^= rng[0];
+    rng[3] ^= rng[1];
+    rng[1] ^= rng[2];
+    rng[0] ^= rng[3];
+    rng[2] ^= t;
+    rng[3] = std::rotl(rng[3], 45);
 
-                    case SDL_SCANCODE_C: { // B
-                        keypad[11] = 1;
-                        break;
-                    }
+    return result >> 56;
+}
 
-                    case SDL_SCANCODE_V: { // F
-                        keypad[15] = 1;
-                        break;
-                    }
+// Places a left aligned sprite row at column x (0 - 127) of a 128 pixel row, anything past the right edge is clipped
+static void place_row(uint64_t sprite, int x, uint64_t& left, uint64_t& right) {
+    left = 0;
+    right = 0;
+    if (x == 0) {
+        left = sprite;
+    }
+    else if (x < 64) {
+        left = sprite >> x;
+        right = sprite << (64 - x);
+    }
+    else {
+        right = sprite >> (x - 64);
+    }
+}
 
-                    default: {
-                        break;
-                    }
-                }
-                break;
+template <int Chip, bool HighRes, bool Large>
+void Chip8::op_DXYN(const Opcode& op) { // Display
+    // Each sprite row is one shift, one AND for collision and one XOR
+    if constexpr (Chip == CHIP_8) {
+        uint8_t X = V[op.x] & 63; // AND 63 is the same as modulo
+        uint8_t Y = V[op.y] & 31;
+        V[15] = 0;
+        display_changed = 1;
+
+        for (int row = 0; row < op.n && Y + row < 32; ++row) { // Clipped at the bottom
+            uint64_t bits = (static_cast<uint64_t>(memory[I + row]) << 56) >> X; // Clipped at the right edge
+            uint64_t& line = screen[Y + row];
+
+            if (line & bits) { // Both 1, turn off and set flag
+                V[15] = 1;
             }
+            line ^= bits;
+            dirty_rows |= static_cast<uint64_t>(bits != 0) << (Y + row);
+        }
+    }
+    else if constexpr (!HighRes) { // Low resolution uses the top left 64x32, one word per row
+        int X = V[op.x] & 63;
+        int Y = V[op.y] & 31;
+        int rows = std::min<int>(op.n, 32 - Y); // Clipped at the bottom, DXY0 draws nothing
+        bool collided = false;
+        uint64_t drawn = 0; // Rows with pixels in them
+
+        for (int j = 0; j < rows; ++j) {
+            uint64_t bits = (static_cast<uint64_t>(memory[I + j]) << 56) >> X; // Clipped at the right edge
+            uint64_t& line = screen_super[Y + j][0];
+            collided |= (line & bits) != 0;
+            line ^= bits;
+            drawn |= static_cast<uint64_t>(bits != 0) << (Y + j);
+        }
+        V[15] = collided;
+        dirty_rows |= drawn;
+        display_changed |= drawn != 0;
+    }
+    else {
+        constexpr int bytes_per_row = Large ? 2 : 1; // DXY0 sprites are 16x16, two bytes per row
+        int X = V[op.x] & 127;
+        int Y = V[op.y] & 63;
+        int height = Large ? 16 : op.n;
+        int rows = std::min(height, 64 - Y); // Clipped at the bottom
+        int collisions = 0; // Rows that collided
+        uint64_t drawn = 0;
+
+        for (int j = 0; j < rows; ++j) {
+            uint64_t sprite = Large ? (memory[I + 2*j] << 8 | memory[I + 2*j + 1]) : memory[I + j];
+            sprite <<= 64 - 8 * bytes_per_row; // Left aligned
+
+            uint64_t left;
+            uint64_t right;
+            place_row(sprite, X, left, right);
+
+            uint64_t* line = screen_super[Y + j];
+            collisions += ((line[0] & left) | (line[1] & right)) != 0;
+            line[0] ^= left;
+            line[1] ^= right;
+            drawn |= static_cast<uint64_t>((left | right) != 0) << (Y + j);
+        }
+        dirty_rows |= drawn;
+        display_changed |= drawn != 0;
 
-            case SDL_KEYUP: {
-                switch(event.key.keysym.scancode) {
-                    case SDL_SCANCODE_1: { // 1
-                        keypad[1] = 0;
-                        break;
-                    }
-
-                    case SDL_SCANCODE_2: { // 2
-                        keypad[2] = 0;
-                        break;
-                    }
+        if constexpr (Chip == SUPER_CHIP_LEGACY) {
+            V[15] = collisions + (height - rows); // Clipped rows count too
+        }
+        else {
+            V[15] = collisions != 0;
+        }
+    }
+}
 
-                    case SDL_SCANCODE_3: { // 3
-                        keypad[3] = 0;
-                        break;
-                    }
+// Skip if
+void Chip8::op_EXA1(const Opcode& op) {
+    uint8_t Vx = V[op.x] & 0xF; // Only 16 keys
+    if (!((keypad >> Vx) & 1)) {
+        PC += 0x002;
+    }
+}
 
-                    case SDL_SCANCODE_4: { // C
-                        keypad[12] = 0;
-                        break;
-                    }
+void Chip8::op_EX9E(const Opcode& op) {
+    uint8_t Vx = V[op.x] & 0xF;
+    if ((keypad >> Vx) & 1) {
+        PC += 0x002;
+    }
+}
 
-                    case SDL_SCANCODE_Q: { // 4
-                        keypad[4] = 0;
-                        break;
-                    }
+void Chip8::op_FX30(const Opcode& op) { // Set I to big hex location
+    I = 0x0A0 + (V[op.x] & 0xF) * 10; // 10 bytes per SUPER_CHIP digit
+}
 
-                    case SDL_SCANCODE_W: { // 5
-                        keypad[5] = 0;
-                        break;
-                    }
+void Chip8::op_FX33(const Opcode& op) { // Binary coded decimal conversion
+    int Vx = V[op.x];
+    memory[I] = Vx / 100;
+    memory[I+1] = (Vx % 100) / 10;
+    memory[I+2] = Vx % 10;
+    code_written(I, 3);
+}
 
-                    case SDL_SCANCODE_E: { // 6
-                        keypad[6] = 0;
-                        break;
-                    }
+void Chip8::op_FX15(const Opcode& op) { // Set delay timer
+    delay_countdown = V[op.x];
+}
 
-                    case SDL_SCANCODE_R: { // D
-                        keypad[13] = 0;
-                        break;
-                    }
+template <int Quirks>
+void Chip8::op_FX55(const Opcode& op) { // Store into memory
+    uint16_t start = I;
+    int count = op.x + 1;
+    if constexpr (Quirks & MEMORY_INCREMENT) {
+        for (int i = 0; i < count; ++ i) {
+            memory[I] = V[i];
+            ++I;
+        }
+    }
+    else {
+        for (int i = 0; i < count; ++ i) {
+            memory[I+i] = V[i];
+        }
+    }
+    code_written(start, count);
+}
 
-                    case SDL_SCANCODE_A: { // 7
-                        keypad[7] = 0;
-                        break;
-                    }
+template <int Quirks>
+void Chip8::op_FX65(const Opcode& op) { // Load from memory
+    if constexpr (Quirks & MEMORY_INCREMENT) {
+        for (int i = 0; i < op.x + 1; ++ i) {
+            V[i] = memory[I];
+            ++I;
+        }
+    }
+    else {
+        for (int i = 0; i < op.x + 1; ++ i) {
+            V[i] = memory[I+i];
+        }
+    }
+}
 
-                    case SDL_SCANCODE_S: { // 8
-                        keypad[8] = 0;
-                        break;
-                    }
+void Chip8::op_FX75(const Opcode& op) { // Save to flag registers
+    int count = op.x;
+    if (count > 7) { // Only 8 flag registers
+        count = 7;
+    }
+    for (int i = 0; i <= count; ++i) {
+        flag[i] = V[i];
+    }
+}
 
-                    case SDL_SCANCODE_D: { // 9
-                        keypad[9] = 0;
-                        break;
-                    }
+void Chip8::op_FX85(const Opcode& op) { // Restore from flag registers
+    int count = op.x;
+    if (count > 7) {
+        count = 7;
+    }
+    for (int i = 0; i <= count; ++i) {
+        V[i] = flag[i];
+    }
+}
 
-                    case SDL_SCANCODE_F: { // E
-                        keypad[14] = 0;
-                        break;
-                    }
+void Chip8::op_FX07(const Opcode& op) { // Read delay timer
+    V[op.x] = delay_countdown;
+}
 
-                    case SDL_SCANCODE_Z: { // A
-                        keypad[10] = 0;
-                        break;
-                    }
+void Chip8::op_FX18(const Opcode& op) { // Set sound timer
+    sound_countdown = V[op.x];
+}
 
-                    case SDL_SCANCODE_X: { // 0
-                        keypad[0] = 0;
-                        break;
-                    }
+void Chip8::op_FX29(const Opcode& op) { // Set I to font location
+    I = 0x050 + (V[op.x] & 0xF) * 5; // 5 bytes per digit
+}
 
-                    case SDL_SCANCODE_C: { // B
-                        keypad[11] = 0;
-                        break;
-                    }
+void Chip8::op_FX1E(const Opcode& op) { // Add index and set flag
+    int Vx = V[op.x];
 
-                    case SDL_SCANCODE_V: { // F
-                        keypad[15] = 0;
-                        break;
-                    }
+    I += V[op.x];
 
-                    default: {
-                        break;
-                    }
-                }
-                break;       
-            }
-        }
-            
+    if (Vx+I > 255) {
+        V[15] = 1;
+    }
+    else {
+        V[15] = 0;
     }
-    return running;
 }
 
-void Chip8::display(SDL_Renderer* renderer) {
-    // Update output to new display state created by cycle
-    // Clear display
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderClear(renderer);
-
-    // Draw on pixels
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-
-    if (chip == CHIP_8) {
-        SDL_Rect rects[2048];
-        int count = 0;
-
-        for (int y = 0; y < 32; ++y) {
-            for (int x = 0; x < 64; ++x) {
-                if (screen[x][y]) {
-                    rects[count++] = {x, y, 1, 1};
-                }
-            }
-        }
-
-        SDL_RenderFillRects(renderer, rects, count); // Fill all at the same time
+void Chip8::op_FX0A(const Opcode& op) { // Get key
+    if (!running) {
+        return;
     }
-    
-
-    else { // SUPER_CHIP high resolution screen
 
-        if (high_res) {
-            SDL_RenderSetLogicalSize(renderer, 128, 64);
-        } 
-        else {
-            SDL_RenderSetLogicalSize(renderer, 64, 32);
-        }
-
-        SDL_Rect rects[8192];
-        int count = 0;
-
-        for (int y = 0; y < 64; ++y) {
-            for (int x = 0; x < 128; ++x) {
-                if (screen_super[x][y]) {
-                    rects[count++] = {x, y, 1, 1};
-                }
-            }
-        }
-        
-        SDL_RenderFillRects(renderer, rects, count);
-        
+    if (key && !((keypad >> index) & 1)) { // Waits for the key to be released
+        V[op.x] = index;
+        key = false;
+        return;
     }
-    
-    SDL_RenderPresent(renderer);
+    index = std::countr_zero(keypad); // Lowest key down, 16 when none is
+    key = keypad != 0;
+
+    PC -= 0x002;
 }
 
 void Chip8::load_game(const std::string& path) {
@@ -1014,8 +705,132 @@ void Chip8::load_game(const std::string& path) {
         throw std::runtime_error("Failed to read ROM");
     }
 
-    std::memcpy(&memory[0x200], buffer.data(), buffer.size());
+    load_rom(buffer.data(), buffer.size());
+}
 
+void Chip8::load_rom(const uint8_t* data, size_t size) {
+    load_rom(data, size, fnv1a(data, size));
+}
+
+void Chip8::load_rom(const uint8_t* data, size_t size, uint64_t hash) {
+    if (size == 0) { // data may be null then
+        throw std::runtime_error("ROM is empty");
+    }
+    if (size > (4096 - 0x200)) {
+        throw std::runtime_error("Size of rom too large");
+    }
+    std::memcpy(&memory[0x200], data, size);
+    const QuirkProfile* profile = find_quirk_profile(hash);
+    set_quirks(profile ? profile->quirks : default_quirks(chip)); // Also flushes the blocks
+    written_pages |= page_mask(0x200, size);
+}
+
+void Chip8::set_quirks(int flags) {
+    quirks = flags & (QUIRK_SETS - 1);
+    load_tables();
+    flush_blocks(); // Blocks hold handlers from the old table, compiled code has the old quirks built in
+}
+
+int Chip8::get_quirks() {
+    return quirks;
+}
+
+int Chip8::default_quirks(int type) {
+    return (type == CHIP_8) ? (VF_RESET | SHIFT_VY | MEMORY_INCREMENT) : JUMP_VX; // SCHIP 1.1 and modern SUPER-CHIP agree on these
+}
+
+// Everything restart() puts back, memory is only copied for written pages
+struct Chip8::Pristine {
+    uint8_t memory[0x1000];
+    uint64_t screen[32];
+    uint64_t screen_super[64][2];
+    uint64_t seed;
+    uint64_t rng[4];
+    uint16_t PC;
+    uint16_t I;
+    uint16_t stack[16];
+    uint8_t sp;
+    uint8_t V[16];
+    uint8_t flag[8];
+    uint8_t delay_countdown;
+    uint8_t sound_countdown;
+    uint16_t keypad;
+    bool high_res;
+    bool running;
+    int fault;
+    bool key;
+    uint8_t index;
+    int quirks;
+};
+
+void Chip8::snapshot_pristine() {
+    auto image = std::make_shared<Pristine>();
+    memcpy(image->memory, memory, sizeof(memory));
+    memcpy(image->screen, screen, sizeof(screen));
+    memcpy(image->screen_super, screen_super, sizeof(screen_super));
+    image->seed = seed;
+    memcpy(image->rng, rng, sizeof(rng));
+    image->PC = PC;
+    image->I = I;
+    memcpy(image->stack, stack, sizeof(stack));
+    image->sp = sp;
+    memcpy(image->V, V, sizeof(V));
+    memcpy(image->flag, flag, sizeof(flag));
+    image->delay_countdown = delay_countdown;
+    image->sound_countdown = sound_countdown;
+    image->keypad = keypad;
+    image->high_res = high_res;
+    image->running = running;
+    image->fault = fault;
+    image->key = key;
+    image->index = index;
+    image->quirks = quirks;
+
+    pristine = image;
+    written_pages = 0;
+}
+
+void Chip8::restart() {
+    if (!pristine) {
+        throw std::runtime_error("No pristine image to restart from");
+    }
+    const Pristine& image = *pristine;
+
+    // Only pages stored to since the snapshot differ, blocks translated from their current contents are dropped
+    for (uint64_t pages = written_pages; pages; pages &= pages - 1) {
+        int page = std::countr_zero(pages);
+        memcpy(memory + 64 * page, image.memory + 64 * page, 64);
+        code_written(64 * page, 64);
+    }
+    written_pages = 0;
+    memset(page_rewrites, 0, sizeof(page_rewrites)); // Restoring code is not self-modifying code, pages stay compiled
+    volatile_pages = 0;
+
+    memcpy(screen, image.screen, sizeof(screen));
+    memcpy(screen_super, image.screen_super, sizeof(screen_super));
+    seed = image.seed;
+    memcpy(rng, image.rng, sizeof(rng));
+    PC = image.PC;
+    I = image.I;
+    memcpy(stack, image.stack, sizeof(stack));
+    sp = image.sp;
+    memcpy(V, image.V, sizeof(V));
+    memcpy(flag, image.flag, sizeof(flag));
+    delay_countdown = image.delay_countdown;
+    sound_countdown = image.sound_countdown;
+    keypad = image.keypad;
+    high_res = image.high_res;
+    if (quirks != image.quirks) {
+        set_quirks(image.quirks); // Also picks the table for high_res
+    }
+    select_table();
+    running = image.running;
+    fault = image.fault;
+    key = image.key;
+    index = image.index;
+
+    display_changed = 1;
+    dirty_rows = ALL_ROWS;
 }
 
 uint8_t Chip8::get_delay_countdown() {
@@ -1034,6 +849,19 @@ void Chip8::decrement_sound_countdown() {
     sound_countdown -= 1;
 }
 
+void Chip8::tick_timers() {
+    if (delay_countdown > 0) {
+        delay_countdown -= 1;
+    }
+    if (sound_countdown > 0) {
+        sound_countdown -= 1;
+    }
+}
+
+int Chip8::cycles_per_frame(int type) {
+    return (type == CHIP_8) ? 10 : 100;
+}
+
 bool Chip8::get_display_changed() {
     return display_changed;
 }
@@ -1042,10 +870,308 @@ void Chip8::set_display_changed(bool state) {
     display_changed = state;
 }
 
+uint64_t Chip8::get_dirty_rows() {
+    return dirty_rows;
+}
+
+void Chip8::clear_dirty_rows() {
+    dirty_rows = 0;
+}
+
 bool Chip8::is_running() {
     return running;
 }
 
+int Chip8::get_fault() {
+    return fault;
+}
+
+const char* Chip8::fault_name(int fault) {
+    switch (fault) {
+        case NO_FAULT: return "none";
+        case STACK_OVERFLOW: return "stack overflow";
+        case STACK_UNDERFLOW: return "stack underflow";
+        case PC_OUT_OF_RANGE: return "PC out of range";
+        default: return "unknown";
+    }
+}
+
+bool Chip8::parse_mode(const std::string& name, int& mode) {
+    if (name == "interpreter") {
+        mode = INTERPRETER;
+    }
+    else if (name == "blocks") {
+        mode = BLOCK_CACHE;
+    }
+    else if (name == "jit") {
+        mode = JIT;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+const char* Chip8::mode_name(int mode) {
+    switch (mode) {
+        case INTERPRETER: return "interpreter";
+        case BLOCK_CACHE: return "blocks";
+        case JIT: return "jit";
+        default: return "unknown";
+    }
+}
+
+bool Chip8::write_profile(const std::string& prefix) {
+#ifdef CHIP8_PROFILE
+    return profiler.write(prefix, memory);
+#else
+    (void)prefix;
+    return false;
+#endif
+}
+
+void Chip8::stop(int reason) {
+    PC -= 0x002; // Back on the faulting instruction
+    fault = reason;
+    running = false;
+}
+
+bool Chip8::matches(const Chip8& other) const {
+    // Compares everything a program can observe
+    return PC == other.PC && I == other.I
+        && memcmp(V, other.V, sizeof(V)) == 0
+        && memcmp(flag, other.flag, sizeof(flag)) == 0
+        && memcmp(memory, other.memory, sizeof(memory)) == 0
+        && delay_countdown == other.delay_countdown && sound_countdown == other.sound_countdown
+        && sp == other.sp && memcmp(stack, other.stack, sp * sizeof(stack[0])) == 0
+        && memcmp(screen, other.screen, sizeof(screen)) == 0
+        && memcmp(screen_super, other.screen_super, sizeof(screen_super)) == 0
+        && high_res == other.high_res && running == other.running && fault == other.fault
+        && memcmp(rng, other.rng, sizeof(rng)) == 0;
+}
+
+// Layout of a save state, largest fields first and the tail filled up by reserved, so every byte is written
+struct SavedState {
+    char magic[4]; // "C8ST"
+    uint32_t version;
+    uint8_t memory[0x1000];
+    uint64_t screen[32];
+    uint64_t screen_super[64][2];
+    uint64_t seed;
+    uint64_t rng[4];
+    uint16_t PC;
+    uint16_t I;
+    uint16_t stack[16]; // Bottom first
+    uint16_t keypad; // Bit n is key n
+    uint8_t V[16];
+    uint8_t flag[8];
+    uint8_t delay_countdown;
+    uint8_t sound_countdown;
+    uint8_t stack_depth;
+    uint8_t chip;
+    uint8_t high_res;
+    uint8_t running;
+    uint8_t display_changed;
+    uint8_t key; // FX0A waiting for release
+    uint8_t index; // FX0A key
+    uint8_t fault;
+    uint8_t quirks;
+    uint8_t reserved[7]; // Zero, up to the alignment of the uint64_t fields
+};
+
+static const char STATE_MAGIC[4] = {'C', '8', 'S', 'T'};
+static constexpr uint32_t STATE_VERSION = 3; // 2 replaced a reserved byte with the fault, 3 added the quirks
+static_assert(sizeof(SavedState) == Chip8::STATE_SIZE, "Save state layout changed, bump STATE_VERSION");
+static_assert(offsetof(SavedState, reserved) + sizeof(SavedState::reserved) == Chip8::STATE_SIZE, "Save state has padding");
+
+void Chip8::save_state(uint8_t* out) {
+    SavedState state;
+    memcpy(state.magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+    state.version = STATE_VERSION;
+    memcpy(state.memory, memory, sizeof(memory));
+    memcpy(state.screen, screen, sizeof(screen));
+    memcpy(state.screen_super, screen_super, sizeof(screen_super));
+    state.seed = seed;
+    memcpy(state.rng, rng, sizeof(rng));
+    state.PC = PC;
+    state.I = I;
+
+    memcpy(state.stack, stack, sizeof(stack));
+    state.stack_depth = sp;
+
+    state.keypad = get_keypad();
+    memcpy(state.V, V, sizeof(V));
+    memcpy(state.flag, flag, sizeof(flag));
+    state.delay_countdown = delay_countdown;
+    state.sound_countdown = sound_countdown;
+    state.chip = chip;
+    state.high_res = high_res;
+    state.running = running;
+    state.display_changed = display_changed;
+    state.key = key;
+    state.index = index;
+    state.fault = fault;
+    state.quirks = quirks;
+    memset(state.reserved, 0, sizeof(state.reserved));
+
+    memcpy(out, &state, sizeof(state));
+}
+
+void Chip8::load_state(const uint8_t* in, size_t size) {
+    SavedState state;
+    if (size != sizeof(state)) {
+        throw std::runtime_error("Save state has the wrong size");
+    }
+    memcpy(&state, in, sizeof(state));
+
+    if (memcmp(state.magic, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0 || state.version != STATE_VERSION) {
+        throw std::runtime_error("Unsupported save state version");
+    }
+    if (state.chip != chip) {
+        throw std::runtime_error("Save state is for another chip type");
+    }
+    if (state.stack_depth > 16 || state.index > 16) { // index is 16 while FX0A sees no key down
+        throw std::runtime_error("Save state is corrupt");
+    }
+
+    memcpy(memory, state.memory, sizeof(memory));
+    quirks = state.quirks & (QUIRK_SETS - 1);
+    high_res = state.high_res;
+    load_tables();
+    flush_blocks(); // Cached blocks describe the old memory
+    written_pages = ~0ULL;
+    memcpy(screen, state.screen, sizeof(screen));
+    memcpy(screen_super, state.screen_super, sizeof(screen_super));
+    seed = state.seed;
+    memcpy(rng, state.rng, sizeof(rng));
+    PC = state.PC; // May be past memory after PC_OUT_OF_RANGE, cycle() stops on it again
+    I = state.I;
+
+    memcpy(stack, state.stack, sizeof(stack));
+    sp = state.stack_depth;
+
+    set_keypad(state.keypad);
+    memcpy(V, state.V, sizeof(V));
+    memcpy(flag, state.flag, sizeof(flag));
+    delay_countdown = state.delay_countdown;
+    sound_countdown = state.sound_countdown;
+    running = state.running;
+    display_changed = state.display_changed;
+    dirty_rows = ALL_ROWS; // Nothing on screen can be trusted
+    key = state.key;
+    index = state.index;
+    fault = state.fault;
+}
+
+void Chip8::set_key(uint8_t key, bool pressed) {
+    uint16_t bit = 1 << (key & 0xF);
+    keypad = pressed ? (keypad | bit) : (keypad & ~bit);
+}
+
+bool Chip8::get_key(uint8_t key) {
+    return (keypad >> (key & 0xF)) & 1;
+}
+
+uint16_t Chip8::get_pc() {
+    return PC;
+}
+
+uint16_t Chip8::get_index() {
+    return I;
+}
+
+uint8_t Chip8::get_register(uint8_t x) {
+    return V[x & 0xF];
+}
+
+void Chip8::set_keypad(uint16_t keys) {
+    keypad = keys;
+}
+
+uint16_t Chip8::get_keypad() {
+    return keypad;
+}
+
+int Chip8::get_chip() {
+    return chip;
+}
+
+bool Chip8::is_high_res() {
+    return high_res;
+}
+
+int Chip8::get_width() {
+    return (chip != CHIP_8 && high_res) ? 128 : 64;
+}
+
+int Chip8::get_height() {
+    return (chip != CHIP_8 && high_res) ? 64 : 32;
+}
+
+bool Chip8::get_pixel(int x, int y) {
+    return (get_row(y)[x >> 6] >> (63 - (x & 63))) & 1;
+}
+
+const uint64_t* Chip8::get_row(int y) {
+    if (chip == CHIP_8) {
+        return &screen[y];
+    }
+    return screen_super[y]; // SUPER_CHIP draws low resolution into the top left corner
+}
+
+static const uint32_t ON = 0xFFFFFFFF; // ARGB8888
+static const uint32_t OFF = 0xFF000000;
+
+// Every byte of a packed row unpacks to 8 ARGB pixels with one 32 byte copy
+struct Unpack {
+    uint32_t pixels[256][8];
+
+    Unpack() {
+        for (int byte = 0; byte < 256; ++byte) {
+            for (int bit = 0; bit < 8; ++bit) {
+                pixels[byte][bit] = ((byte >> (7 - bit)) & 1) ? ON : OFF;
+            }
+        }
+    }
+};
+
+static const Unpack unpack;
+
+void Chip8::get_argb(uint32_t* pixels, uint64_t rows) {
+    int words = get_width() / 64;
+
+    for (int y = 0; y < get_height(); ++y, pixels += 8 * 8 * words) {
+        if (!((rows >> y) & 1)) {
+            continue; // Left as it was
+        }
+
+        const uint64_t* row = get_row(y);
+        uint32_t* out = pixels;
+        for (int w = 0; w < words; ++w) {
+            for (int shift = 56; shift >= 0; shift -= 8) { // Bit 63 is the leftmost pixel
+                memcpy(out, unpack.pixels[(row[w] >> shift) & 0xFF], sizeof(unpack.pixels[0]));
+                out += 8;
+            }
+        }
+    }
+}
+
+uint64_t Chip8::screen_hash() {
+    uint64_t hash = fnv1a(nullptr, 0); // Offset basis
+    int words = get_width() / 64;
+
+    for (int y = 0; y < get_height(); ++y) {
+        const uint64_t* row = get_row(y);
+        for (int w = 0; w < words; ++w) {
+            for (int shift = 56; shift >= 0; shift -= 8) { // Leftmost pixels first
+                uint8_t pixels = row[w] >> shift;
+                hash = fnv1a(&pixels, 1, hash);
+            }
+        }
+    }
+    return hash;
+}
+
 void Chip8::reset() {
     // Clear memory and revert to state
     PC = 0x200;
@@ -1054,6 +1180,9 @@ void Chip8::reset() {
     
     I = 0;
     memset(memory + 0x200, 0, sizeof(memory) - 0x200); // Resets non-reserved memory
+    flush_blocks();
+    written_pages = ~0ULL;
+    seed_rng();
     
     memset(screen, 0, sizeof(screen));
     memset(screen_super, 0, sizeof(screen_super)); // SUPER_CHIP high resolution screen
@@ -1061,19 +1190,22 @@ void Chip8::reset() {
     memset(V, 0, sizeof(V));
     memset(flag, 0, sizeof(flag));
 
-    while (!stack.empty()) {
-        stack.pop();
-    }
+    memset(stack, 0, sizeof(stack));
+    sp = 0;
+    fault = NO_FAULT;
+#ifdef CHIP8_PROFILE
+    profiler.clear();
+#endif
 
-    memset(keypad, 0, sizeof(keypad));
+    keypad = 0;
     index = 0;
     key = false;
 
     high_res = false;
+    select_table();
 
-    pixels_vertical = 0;
-    pixels_horizontal = 0;
     display_changed = 1;
+    dirty_rows = ALL_ROWS;
     
 }
 
@@ -2,36 +2,121 @@
 #define CHIP8_H
 
 #include <cstdint> // For uint16_t
-#include <stack> // Stack variable
 #include <iostream>
 #include <fstream> // Getting rom
 #include <string> // Specifying path
 #include <cstring>
-#include <random> // For CXNN
+#include <random> // Default CXNN seed
 #include <chrono> // For timer and display
 #include <stdexcept>
 #include <vector>
-#include <SDL2/SDL.h> // IO, sound
+#include <utility> // std::integer_sequence
+#include <memory> // JIT code buffer
+#ifdef CHIP8_PROFILE
+#include "profile.h"
+#endif
 
-#define SCALE 10
+// FNV-1a, what ROMs and screens are identified by. Pass an earlier result as hash to continue it
+inline uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t hash = 0xCBF29CE484222325) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001B3; // FNV prime
+    }
+    return hash;
+}
 
 class Chip8 {
 
     public: 
     static constexpr int CHIP_8 = 1;
     static constexpr int SUPER_CHIP = 2; // Modern
+    static constexpr int SUPER_CHIP_LEGACY = 3; // SCHIP 1.1, high resolution DXYN sets VF to the rows that collided or were clipped
+    static constexpr int VARIANTS = 3; // Machine types, each one is a template argument of the decode tables
+
+    static constexpr uint64_t ALL_ROWS = ~0ULL;
+
+    // Compatibility quirks, each one independent. Every chip type has a default set, known ROMs get theirs from quirks.h
+    static constexpr int VF_RESET = 1; // 8XY1/8XY2/8XY3 clear VF
+    static constexpr int SHIFT_VY = 2; // 8XY6/8XYE shift VY into VX instead of shifting VX in place
+    static constexpr int JUMP_VX = 4; // BXNN jumps to XNN + VX instead of BNNN to NNN + V0
+    static constexpr int MEMORY_INCREMENT = 8; // FX55/FX65 leave I one past the last register
+    static constexpr int QUIRK_SETS = 16; // Every combination has its own decode table
+
+    // Faults, execution stops on the faulting instruction
+    static constexpr int NO_FAULT = 0;
+    static constexpr int STACK_OVERFLOW = 1; // 2NNN with 16 calls pending
+    static constexpr int STACK_UNDERFLOW = 2; // 00EE with no call pending
+    static constexpr int PC_OUT_OF_RANGE = 3; // Fetch at 0xFFF or beyond, a skip or BXNN ran off the end of memory
+
+    // Execution modes for run()
+    static constexpr int INTERPRETER = 0; // Fetch and decode every instruction
+    static constexpr int BLOCK_CACHE = 1; // Straight-line code is decoded once into cached blocks
+    static constexpr int JIT = 2; // Block cache, hot blocks are also compiled to x86-64
+    static bool parse_mode(const std::string& name, int& mode); // "interpreter", "blocks" or "jit", false for anything else
+    static const char* mode_name(int mode);
+
+    // Timing shared by the frontend and the tools: instructions run per 60 Hz frame, then the timers tick once
+    static int cycles_per_frame(int type); // 10 for CHIP_8 (600 Hz), 100 for both SUPER_CHIPs (6000 Hz)
+    void tick_timers(); // Counts the delay and sound timers down, once per frame
     
     // Constructor
-    Chip8(int type = CHIP_8) : chip(type), high_res(false), running(true), key(false), index(0) {   
+    Chip8(int type = CHIP_8) : chip(type), quirks(default_quirks(type)), high_res(false), running(true), key(false), index(0) {   
+        if (type < CHIP_8 || type > VARIANTS) {
+            throw std::runtime_error("Unknown chip type");
+        }
+        table = nullptr;
+        load_tables(); // reset() picks the one for the resolution
+        mode = INTERPRETER;
+        std::random_device rd; // Only read once, set_seed makes runs reproducible
+        seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+        memset(memory, 0, sizeof(memory));
         add_fonts();
         reset();
 
     }
 
     void cycle(); // Advances execution
-    bool poll(SDL_Event event); // Gets all inputs
-    void display(SDL_Renderer* renderer); // Shows display state, 60 HZ
+    uint64_t run(uint64_t cycles); // Runs up to cycles instructions in the current mode, returns how many ran
+    void set_mode(int execution_mode);
+    int get_mode();
     void load_game(const std::string& path); // Loads game into memory
+    void load_rom(const uint8_t* data, size_t size); // Same from a buffer, also picks the quirks for the ROM
+    void load_rom(const uint8_t* data, size_t size, uint64_t hash); // hash is fnv1a() of data, for callers that have it
+    void set_quirks(int flags); // Switches decode tables, translated blocks are dropped
+    int get_quirks();
+    static int default_quirks(int type); // CHIP_8: VF_RESET | SHIFT_VY | MEMORY_INCREMENT, both SUPER_CHIPs: JUMP_VX
+    // Pristine image for workloads that rerun one ROM, restart() returns to the state at snapshot_pristine()
+    // and only copies back the memory pages written since
+    void snapshot_pristine();
+    void restart(); // Throws without a snapshot
+    void set_seed(uint64_t value); // Restarts the CXNN generator, reset() goes back to the same sequence
+    uint64_t get_seed();
+
+    // Snapshots, a versioned fixed layout blob in host byte order, the execution mode is not part of it
+    static constexpr size_t STATE_SIZE = 5504;
+    void save_state(uint8_t* out); // Writes STATE_SIZE bytes
+    void load_state(const uint8_t* in, size_t size); // Throws on a blob from another version or chip type
+
+    // Input, keys are 0x0 - 0xF
+    void set_key(uint8_t key, bool pressed);
+    bool get_key(uint8_t key);
+    void set_keypad(uint16_t keys); // Bit n is key n, used by replays and the frontend once per frame
+    uint16_t get_keypad();
+
+    // CPU state, read only
+    uint16_t get_pc();
+    uint16_t get_index();
+    uint8_t get_register(uint8_t x); // V0 - VF
+
+    // Framebuffer of the active screen
+    int get_chip();
+    bool is_high_res();
+    int get_width(); // 64 or 128
+    int get_height(); // 32 or 64
+    bool get_pixel(int x, int y);
+    const uint64_t* get_row(int y); // Packed pixels, 1 word or 2 in high resolution, bit 63 of the first is x = 0
+    void get_argb(uint32_t* pixels, uint64_t rows = ALL_ROWS); // get_width() * get_height() ARGB8888 pixels, white on black, only rows set in the mask are written
+    uint64_t screen_hash(); // FNV-1a of the active screen, for comparing runs
 
     uint8_t get_delay_countdown();
     void decrement_delay_countdown();
@@ -39,7 +124,13 @@ class Chip8 {
     void decrement_sound_countdown();
     bool get_display_changed();
     void set_display_changed(bool state);
+    uint64_t get_dirty_rows(); // Bit y is set when row y changed since clear_dirty_rows()
+    void clear_dirty_rows();
     bool is_running();
+    int get_fault(); // NO_FAULT unless execution stopped on an error
+    static const char* fault_name(int fault);
+    bool write_profile(const std::string& prefix); // Profiling builds write prefix.txt and prefix.folded, others return false
+    bool matches(const Chip8& other) const; // Same machine state, used to check modes against the interpreter
 
     private: 
 
@@ -50,18 +141,24 @@ class Chip8 {
     uint8_t flag[8]; // Used to save and load registers in SUPER_CHIP
     uint8_t delay_countdown; // Timers' countdown values
     uint8_t sound_countdown;
-    std::stack<uint16_t> stack; // Reserve the stack, LIFO
-    bool screen[64][32]; // [x][y] 
-    bool screen_super[128][64];
-
-    int pixels_vertical; // SUPER_CHIP scroll down amount, should be negative or 0
-    int pixels_horizontal; // SUPER_CHIP horizontally scrolled amount, left is negative, right is positive
+    uint16_t stack[16]; // Return addresses, 16 levels like the original interpreters
+    uint8_t sp; // Next free stack entry
+    uint64_t screen[32]; // One word per row, bit 63 is x = 0
+    uint64_t screen_super[64][2]; // Two words per row, x = 0 - 63 then 64 - 127
 
     int chip;
-    bool keypad[16]; // 1-4 down to Z-V
+    int quirks;
+    uint16_t keypad; // Bit n is key n, EX9E/EXA1 test a bit and FX0A takes the lowest set
     bool display_changed; // 1 if instruction changed display state
+    uint64_t dirty_rows; // Rows changed since the frontend last cleared them
     bool high_res;
     bool running;
+    int fault;
+    void stop(int reason); // Stops with PC on the current instruction
+
+#ifdef CHIP8_PROFILE
+    Profiler profiler; // run() only interprets in profiling builds so every instruction is counted
+#endif
 
     void reset(); // Reset to boot state
     void add_fonts(); // Adds fonts to reserved memory 0x050 - 0x09F
@@ -69,6 +166,160 @@ class Chip8 {
     // For FX0A
     bool key;
     uint8_t index;
+
+    // For CXNN, xoshiro256** seeded through splitmix64
+    uint64_t seed;
+    uint64_t rng[4];
+    void seed_rng();
+    uint8_t random_byte();
+
+    // Decoded instruction, operands are extracted once when the table is built
+    struct Opcode;
+    using Handler = void (*)(Chip8&, const Opcode&); // Plain function pointer, cheaper to call than a member pointer
+    struct Opcode {
+        Handler handler;
+        uint16_t nnn;
+        uint8_t x;
+        uint8_t y;
+        uint8_t n;
+        uint8_t nn;
+        bool ends_block; // Jumps, skips, calls, returns, FX0A and stores
+    };
+
+    const Opcode* table; // One entry per instruction 0x0000 - 0xFFFF for this chip type, quirk set and resolution
+    const Opcode* lores_table;
+    const Opcode* hires_table; // The same as lores_table on CHIP_8
+    void load_tables(); // For the chip type and quirks
+    void select_table(); // After high_res changes, drops the blocks when the table does
+
+    template <void (Chip8::*Execute)(const Opcode&)>
+    static void handler(Chip8& chip8, const Opcode& op) { // Table entry point, inlines the member handler
+        (chip8.*Execute)(op);
+    }
+
+    // Variant, quirks and resolution are template arguments so each table's handlers have them resolved at compile time
+    template <int Chip, int Quirks, bool HighRes> static Opcode decode(uint16_t instruction);
+    template <int Chip, int Quirks, bool HighRes> static std::vector<Opcode> build_table();
+    template <int Chip, bool HighRes, int... Quirks> static std::vector<Opcode> build_table(int quirks, std::integer_sequence<int, Quirks...>);
+    static const Opcode* decode_table(int type, int quirks, bool high_res); // Shared between instances, built on first use
+
+    // Instruction handlers, named after the opcode they execute
+    void op_nop(const Opcode& op);
+    void op_00E0(const Opcode& op);
+    void op_00EE(const Opcode& op);
+    void op_00CN(const Opcode& op);
+    void op_00FB(const Opcode& op);
+    void op_00FC(const Opcode& op);
+    void op_00FD(const Opcode& op);
+    void op_00FE(const Opcode& op);
+    void op_00FF(const Opcode& op);
+    void op_1NNN(const Opcode& op);
+    void op_2NNN(const Opcode& op);
+    void op_3XNN(const Opcode& op);
+    void op_4XNN(const Opcode& op);
+    void op_5XY0(const Opcode& op);
+    void op_6XNN(const Opcode& op);
+    void op_7XNN(const Opcode& op);
+    void op_8XY0(const Opcode& op);
+    template <int Quirks> void op_8XY1(const Opcode& op);
+    template <int Quirks> void op_8XY2(const Opcode& op);
+    template <int Quirks> void op_8XY3(const Opcode& op);
+    void op_8XY4(const Opcode& op);
+    void op_8XY5(const Opcode& op);
+    template <int Quirks> void op_8XY6(const Opcode& op);
+    void op_8XY7(const Opcode& op);
+    template <int Quirks> void op_8XYE(const Opcode& op);
+    void op_9XY0(const Opcode& op);
+    void op_ANNN(const Opcode& op);
+    template <int Quirks> void op_BNNN(const Opcode& op);
+    void op_CXNN(const Opcode& op);
+    template <int Chip, bool HighRes, bool Large> void op_DXYN(const Opcode& op); // Large is DXY0, 16x16 in high resolution
+    void op_EX9E(const Opcode& op);
+    void op_EXA1(const Opcode& op);
+    void op_FX07(const Opcode& op);
+    void op_FX0A(const Opcode& op);
+    void op_FX15(const Opcode& op);
+    void op_FX18(const Opcode& op);
+    void op_FX1E(const Opcode& op);
+    void op_FX29(const Opcode& op);
+    void op_FX30(const Opcode& op);
+    void op_FX33(const Opcode& op);
+    template <int Quirks> void op_FX55(const Opcode& op);
+    template <int Quirks> void op_FX65(const Opcode& op);
+    void op_FX75(const Opcode& op);
+    void op_FX85(const Opcode& op);
+
+    // Block cache, see block_cache.cpp
+    using NativeCode = void (*)(uint8_t* registers); // Compiled by the JIT, called with V
+    struct Block {
+        uint16_t start; // Address of the first instruction
+        uint16_t end; // One past the last instruction
+        uint32_t first; // Index of the first micro-op in block_ops
+        uint32_t length; // Number of micro-ops
+        uint32_t hits; // Times entered, the JIT compiles blocks once they are hot
+        uint32_t compiled_length; // Leading micro-ops covered by compiled, 0 if not compiled
+        NativeCode compiled;
+    };
+
+    int mode;
+    std::vector<Block> blocks;
+    std::vector<Opcode> block_ops; // Micro-ops of every block, back to back
+    uint16_t block_at[0x1000]; // Index + 1 into blocks by start address, 0 if not translated
+    uint64_t block_starts[64]; // Per 64 byte page, bit per address where a live block starts
+    uint64_t code_pages; // Bit per 64 byte page of memory that holds translated code
+    uint8_t page_rewrites[64]; // Blocks dropped by stores, per page
+    uint64_t volatile_pages; // Pages rewritten so often they are interpreted instead
+
+    uint16_t translate(uint16_t address); // Builds the block starting at address, returns its index + 1
+    void invalidate_blocks(uint16_t address, int length);
+    void flush_blocks(); // Drops every block and the self-modifying code history
+    void recycle_blocks(); // Drops every block, used when the block storage fills up
+    static uint64_t page_mask(uint16_t address, int length);
+
+    // Pristine image
+    struct Pristine;
+    std::shared_ptr<const Pristine> pristine; // Copies of a machine share it, it is never changed
+    uint64_t written_pages; // Bit per 64 byte page of memory stored to since the snapshot
+
+    // JIT, see jit.cpp
+    struct CodeBuffer;
+    struct CodeHandle { // Only the owning machine writes to and runs from its buffer, a copy starts without one
+        std::shared_ptr<CodeBuffer> buffer;
+        bool copied = false; // Blocks still point into another machine's buffer, run() drops them first
+
+        CodeHandle() = default;
+        CodeHandle(const CodeHandle&) : copied(true) {}
+        CodeHandle(CodeHandle&& other) noexcept : buffer(std::move(other.buffer)), copied(other.copied) {
+            other.copied = true;
+        }
+        CodeHandle& operator=(const CodeHandle& other) {
+            if (this != &other) {
+                buffer.reset();
+                copied = true;
+            }
+            return *this;
+        }
+        CodeHandle& operator=(CodeHandle&& other) noexcept {
+            if (this != &other) {
+                buffer = std::move(other.buffer);
+                copied = other.copied;
+                other.copied = true;
+            }
+            return *this;
+        }
+    };
+    CodeHandle jit_code;
+
+    bool jit_compile(Block& block);
+    void jit_reset(); // Drops all native code
+
+    void code_written(uint16_t address, int length) { // Called by stores, drops blocks they overwrite
+        uint64_t pages = page_mask(address, length);
+        written_pages |= pages;
+        if (code_pages & pages) {
+            invalidate_blocks(address, length);
+        }
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,332 @@
+#include "frontend.h"
+#include <bit>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <cctype>
+
+KeyMap::KeyMap() {
+    static const SDL_Scancode layout[16] = { // Key n is pressed with layout[n]
+        SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,
+        SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A,
+        SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C,
+        SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V
+    };
+    memset(keys, -1, sizeof(keys));
+    for (int k = 0; k < 16; ++k) {
+        keys[layout[k]] = k;
+    }
+}
+
+void KeyMap::load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Failed to open key map");
+    }
+
+    memset(keys, -1, sizeof(keys));
+    std::string line;
+    while (std::getline(file, line)) {
+        line = line.substr(0, line.find('#'));
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos) {
+            continue; // Blank or comment
+        }
+
+        size_t split = line.find_first_of(" \t", start);
+        size_t name = (split == std::string::npos) ? std::string::npos : line.find_first_not_of(" \t", split);
+        if (split != start + 1 || !isxdigit(static_cast<unsigned char>(line[start])) || name == std::string::npos) {
+            throw std::runtime_error("Bad key map line: " + line);
+        }
+        size_t end = line.find_last_not_of(" \t\r");
+
+        SDL_Scancode code = SDL_GetScancodeFromName(line.substr(name, end - name + 1).c_str());
+        if (code == SDL_SCANCODE_UNKNOWN) {
+            throw std::runtime_error("Unknown key in key map: " + line);
+        }
+        keys[code] = std::stoi(line.substr(start, 1), nullptr, 16);
+    }
+}
+
+int KeyMap::lookup(SDL_Scancode code) const {
+    return (static_cast<unsigned>(code) < SDL_NUM_SCANCODES) ? keys[code] : -1;
+}
+
+bool poll(const KeyMap& keys, std::atomic<uint16_t>& keypad) {
+    // Key events only flip bits, published once all pending events are read
+    SDL_Event event;
+    uint16_t state = keypad.load(std::memory_order_relaxed); // Only this thread writes it
+
+    while (SDL_PollEvent(&event)) {
+        if (event.type == SDL_QUIT) {
+            return false;
+        }
+        if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
+            int key = keys.lookup(event.key.keysym.scancode);
+            if (key >= 0) {
+                uint16_t bit = 1 << key;
+                state = (event.type == SDL_KEYDOWN) ? (state | bit) : (state & ~bit);
+            }
+        }
+    }
+    keypad.store(state, std::memory_order_relaxed);
+    return true;
+}
+
+FrameExchange::FrameExchange() : middle(1), back(0), front(2), sequence(0) {
+    for (int i = 0; i < 3; ++i) {
+        frames[i].width = 0;
+        frames[i].height = 0;
+        stale[i] = Chip8::ALL_ROWS;
+    }
+}
+
+void FrameExchange::publish(Chip8& emulator) {
+    uint64_t rows = emulator.get_dirty_rows();
+    for (uint64_t& mask : stale) {
+        mask |= rows;
+    }
+
+    Frame& frame = frames[back];
+    if (frame.width != emulator.get_width() || frame.height != emulator.get_height()) {
+        frame.width = emulator.get_width();
+        frame.height = emulator.get_height();
+        stale[back] = Chip8::ALL_ROWS; // The row stride changed
+        rows = Chip8::ALL_ROWS;
+    }
+    emulator.get_argb(frame.pixels, stale[back]); // Rows this buffer missed while the other two were out
+    stale[back] = 0;
+    frame.rows = rows;
+    frame.sequence = ++sequence;
+
+    // Release makes the pixels visible to the render thread before the index is
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+    emulator.clear_dirty_rows();
+}
+
+const Frame* FrameExchange::take() {
+    if (!(middle.load(std::memory_order_relaxed) & FRESH)) {
+        return nullptr;
+    }
+    front = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+    return &frames[front];
+}
+
+Renderer::Renderer(SDL_Renderer* renderer) : renderer(renderer), texture(nullptr), width(0), height(0), sequence(0) {}
+
+void Renderer::resize(int w, int h) {
+    if (texture) {
+        SDL_DestroyTexture(texture);
+    }
+    width = w;
+    height = h;
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+    SDL_RenderSetLogicalSize(renderer, width, height); // Keeps the aspect ratio in the window
+}
+
+void Renderer::display(const Frame& frame) {
+    // Only rows that changed since the frame on the texture are uploaded
+    uint64_t rows = frame.rows;
+    if (frame.sequence != sequence + 1) { // Skipped frames, their rows are not in this mask
+        rows = Chip8::ALL_ROWS;
+    }
+    sequence = frame.sequence;
+    if (frame.width != width || frame.height != height) {
+        resize(frame.width, frame.height);
+        rows = Chip8::ALL_ROWS;
+    }
+    rows &= (height == 64) ? Chip8::ALL_ROWS : 0xFFFFFFFF;
+
+    if (rows) {
+        int first = std::countr_zero(rows); // Upload the band from the first changed row to the last
+        int last = 63 - std::countl_zero(rows);
+        SDL_Rect band = {0, first, width, last - first + 1};
+        SDL_UpdateTexture(texture, &band, frame.pixels + first * width, width * sizeof(uint32_t));
+    }
+
+    SDL_RenderCopy(renderer, texture, nullptr, nullptr); // Covers the whole target, no clear needed
+    SDL_RenderPresent(renderer);
+}
+
+Audio::Audio(int buffer_samples) : head(0), tail(0), requested(false), pending(false), waiting{0, false},
+                                   samples_per_frame(735.0), position(0), offset(0), anchored(false), on(false), phase(0), step(0), gain(0) {
+    SDL_AudioSpec want = {};
+    SDL_AudioSpec have;
+    want.freq = 44100;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = buffer_samples; // Latency is about one buffer
+    want.callback = callback;
+    want.userdata = this;
+
+    device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (device == 0) {
+        fprintf(stderr, "Could not open audio: %s\n", SDL_GetError());
+        return;
+    }
+    samples_per_frame = have.freq / 60.0;
+    step = static_cast<uint32_t>(TONE_HZ * 4294967296.0 / have.freq);
+    SDL_PauseAudioDevice(device, 0); // Runs from now on, silence until the first tone
+}
+
+void Audio::close() {
+    if (device != 0) {
+        SDL_CloseAudioDevice(device); // Waits for the callback to return
+        device = 0;
+    }
+}
+
+void Audio::tone(uint64_t frame, bool state) {
+    if (state != requested) {
+        requested = state;
+        waiting = {frame, state}; // Replaces one the ring had no room for, the newest state is the one that matters
+        pending = true;
+    }
+    if (!pending) {
+        return;
+    }
+
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == RING_SIZE) {
+        return; // Full, tried again next frame
+    }
+    ring[h & (RING_SIZE - 1)] = waiting;
+    head.store(h + 1, std::memory_order_release);
+    pending = false;
+}
+
+void Audio::callback(void* userdata, Uint8* stream, int length) {
+    static_cast<Audio*>(userdata)->fill(reinterpret_cast<Sint16*>(stream), length / sizeof(Sint16));
+}
+
+void Audio::fill(Sint16* out, int count) {
+    // Longest an event may sit in the future before the timeline is pulled in, bounds latency after a burst (turbo, rewind)
+    const int64_t max_lead = static_cast<int64_t>(2 * samples_per_frame) + count;
+    int done = 0;
+
+    while (done < count) {
+        // Up to the next event in this buffer, or to the end
+        int until = count;
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t != head.load(std::memory_order_acquire)) {
+            const Event& event = ring[t & (RING_SIZE - 1)];
+            int64_t now = position + done;
+            int64_t emulated = static_cast<int64_t>(event.frame * samples_per_frame);
+            if (!anchored) {
+                offset = now - emulated;
+                anchored = true;
+            }
+            int64_t at = emulated + offset;
+            if (at < now) { // Late, plays now and later events keep their spacing from here
+                offset += now - at;
+                at = now;
+            }
+            else if (at > now + max_lead) { // Emulation ran ahead, pull the timeline in
+                offset -= at - (now + max_lead);
+                at = now + max_lead;
+            }
+
+            if (at == now) {
+                on = event.on;
+                tail.store(t + 1, std::memory_order_release);
+                continue;
+            }
+            if (at < position + count) {
+                until = static_cast<int>(at - position);
+            }
+        }
+
+        int target = on ? AMPLITUDE : 0;
+        for (; done < until; ++done) {
+            if (gain < target) {
+                gain = std::min(gain + 64, target); // About 1 ms from silence to full
+            }
+            else if (gain > target) {
+                gain = std::max(gain - 64, target);
+            }
+            out[done] = (phase < 0x80000000u) ? gain : -gain;
+            phase += step;
+        }
+    }
+    position += count;
+}
+
+Scheduler::Scheduler(double hz) : frames(0), late_frames(0), dropped_frames(0), total_slip(0), max_slip(0) {
+    frequency = SDL_GetPerformanceFrequency();
+    period = static_cast<uint64_t>(frequency / hz);
+    deadline = SDL_GetPerformanceCounter() + period;
+}
+
+void Scheduler::wait() {
+    ++frames;
+    uint64_t now = SDL_GetPerformanceCounter();
+
+    if (now < deadline) {
+        // SDL_Delay only has millisecond resolution, the last partial millisecond is left to the next frame
+        uint32_t ms = static_cast<uint32_t>((deadline - now) * 1000 / frequency);
+        if (ms > 0) {
+            SDL_Delay(ms);
+        }
+        deadline += period; // Deadlines are absolute so rounding never drifts
+        return;
+    }
+
+    uint64_t slip = now - deadline;
+    ++late_frames;
+    total_slip += slip;
+    if (slip > max_slip) {
+        max_slip = slip;
+    }
+
+    if (slip > period) { // Too far behind to catch up, start again from now instead of running frames back to back
+        dropped_frames += slip / period;
+        deadline = now + period;
+    }
+    else {
+        deadline += period;
+    }
+}
+
+bool Scheduler::expired() {
+    return SDL_GetPerformanceCounter() >= deadline;
+}
+
+void Scheduler::restart() {
+    ++frames;
+    deadline = SDL_GetPerformanceCounter() + period;
+}
+
+void Scheduler::report(FILE* out) {
+    double ms = 1000.0 / frequency;
+    fprintf(out, "%llu frames, %llu late (average %.2f ms, max %.2f ms), %llu dropped\n",
+        static_cast<unsigned long long>(frames), static_cast<unsigned long long>(late_frames),
+        late_frames ? total_slip * ms / late_frames : 0.0, max_slip * ms,
+        static_cast<unsigned long long>(dropped_frames));
+}
+
+Throughput::Throughput() : instructions(0), virtual_frames(0), frames(0) {
+    frequency = SDL_GetPerformanceFrequency();
+    start = SDL_GetPerformanceCounter();
+}
+
+void Throughput::add(uint64_t count, uint64_t emulated) {
+    instructions += count;
+    virtual_frames += emulated;
+    ++frames;
+}
+
+void Throughput::report(FILE* out) {
+    uint64_t now = SDL_GetPerformanceCounter();
+    if (now - start < frequency) {
+        return;
+    }
+
+    double seconds = static_cast<double>(now - start) / frequency;
+    fprintf(out, "%.0f instructions/s, %.1f virtual frames/s, %.1f frames/s\n",
+        instructions / seconds, virtual_frames / seconds, frames / seconds);
+
+    start = now;
+    instructions = 0;
+    virtual_frames = 0;
+    frames = 0;
+}
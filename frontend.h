@@ -0,0 +1,159 @@
+#ifndef FRONTEND_H
+#define FRONTEND_H
+
+#include "chip8.h"
+#include <SDL2/SDL.h> // IO, sound
+#include <cstdio>
+#include <atomic>
+#include <string>
+
+#define SCALE 10
+
+// SDL side of the emulator, the core in chip8.h has no SDL dependency
+
+// Scancode to CHIP-8 key table, one lookup per key event
+class KeyMap {
+  public:
+    KeyMap(); // 1234/QWER/ASDF/ZXCV
+
+    // One "key scancode" pair per line, the key a hex digit and the scancode an SDL name such as "Keypad 7" or "Up",
+    // # starts a comment. Replaces the whole map, throws on a line it cannot read
+    void load(const std::string& path);
+    int lookup(SDL_Scancode code) const; // Key 0-F, -1 when not mapped
+
+  private:
+    int8_t keys[SDL_NUM_SCANCODES];
+};
+
+bool poll(const KeyMap& keys, std::atomic<uint16_t>& keypad); // Gets all inputs, bit n of keypad is key n
+
+// One finished screen, converted on the emulation thread
+struct Frame {
+    uint32_t pixels[128 * 64]; // ARGB8888, width * height
+    int width;
+    int height;
+    uint64_t rows; // Rows that changed since the frame published before this one
+    uint64_t sequence; // Counts publishes, a gap means the render thread skipped frames
+};
+
+// Lock-free triple buffer between the emulation thread, which publishes, and the render thread, which takes.
+// Neither side ever waits, the render thread always gets the newest frame and skips any it was too slow for
+class FrameExchange {
+  public:
+    FrameExchange();
+
+    void publish(Chip8& emulator); // Emulation thread, converts the rows the back buffer is missing, swaps it in and clears the dirty rows
+    const Frame* take(); // Render thread, the newest frame or nullptr when nothing was published since the last take
+
+  private:
+    static constexpr int FRESH = 4; // Set in middle while it holds a frame not taken yet
+
+    Frame frames[3];
+    std::atomic<int> middle; // Buffer index | FRESH
+    int back; // Owned by the emulation thread
+    int front; // Owned by the render thread
+    uint64_t stale[3]; // Rows each buffer is behind the emulator, emulation thread only
+    uint64_t sequence;
+};
+
+// Draws frames through one streaming texture, the cost per frame does not depend on lit pixels
+class Renderer {
+  public:
+    Renderer(SDL_Renderer* renderer); // The texture is freed with the SDL_Renderer
+
+    void display(const Frame& frame); // Uploads the rows that changed since the last frame shown and presents
+
+  private:
+    void resize(int width, int height); // Only on a 00FE/00FF resolution switch
+
+    SDL_Renderer* renderer;
+    SDL_Texture* texture;
+    int width;
+    int height;
+    uint64_t sequence; // Of the frame on the texture
+};
+
+// Beeper driven by an SDL audio callback. The emulation thread sends tone on/off events stamped with the
+// virtual frame they happened in through a lock-free ring, the callback applies each at its exact sample
+class Audio {
+  public:
+    Audio(int buffer_samples); // Power of two, 128 samples is about 3 ms at 44.1 kHz. Plays silence if no device opens
+    void close(); // Before SDL_Quit
+
+    void tone(uint64_t frame, bool on); // Emulation thread, every virtual frame, only state changes go into the ring
+
+  private:
+    struct Event {
+        uint64_t frame; // Virtual frames since start
+        bool on;
+    };
+
+    static void callback(void* userdata, Uint8* stream, int length);
+    void fill(Sint16* out, int count); // Audio thread
+
+    static constexpr uint32_t RING_SIZE = 256; // Power of two
+    static constexpr double TONE_HZ = 440.0;
+    static constexpr int AMPLITUDE = 3000;
+
+    SDL_AudioDeviceID device;
+
+    // Single producer, single consumer ring, head written by the emulation thread, tail by the callback
+    Event ring[RING_SIZE];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+
+    // Emulation thread
+    bool requested; // Last state sent or waiting to be sent
+    bool pending; // The ring was full, event still to be sent
+    Event waiting;
+
+    // Audio thread
+    double samples_per_frame; // Output rate / 60
+    int64_t position; // Samples played
+    int64_t offset; // Output sample minus emulated sample, re-anchored when events arrive late or too early
+    bool anchored;
+    bool on;
+    uint32_t phase; // Square wave phase, keeps running through silence so a tone never starts mid-cycle
+    uint32_t step; // Phase increment per sample
+    int gain; // Ramps to AMPLITUDE or 0 over a few samples instead of cutting, no clicks
+};
+
+// Paces the main loop at a fixed rate by sleeping until each deadline instead of spinning
+class Scheduler {
+  public:
+    Scheduler(double hz);
+
+    void wait(); // Sleeps until the next frame deadline
+    bool expired(); // True once the current deadline has passed, for turbo mode
+    void restart(); // Starts the next frame from now without sleeping, for turbo mode
+    void report(FILE* out); // Prints how far behind the deadlines the loop has been
+
+  private:
+    uint64_t frequency; // Performance counter ticks per second
+    uint64_t period; // Ticks per frame
+    uint64_t deadline;
+
+    uint64_t frames;
+    uint64_t late_frames;
+    uint64_t dropped_frames; // Deadlines skipped after falling more than a frame behind
+    uint64_t total_slip; // Ticks past the deadline, summed over late frames
+    uint64_t max_slip;
+};
+
+// Periodic instructions and frames per second, printed about once a second
+class Throughput {
+  public:
+    Throughput();
+
+    void add(uint64_t instructions, uint64_t virtual_frames); // Per presented frame
+    void report(FILE* out); // Prints and starts a new period once a second has passed
+
+  private:
+    uint64_t frequency;
+    uint64_t start;
+    uint64_t instructions;
+    uint64_t virtual_frames; // 60 Hz emulated frames, timers tick once per virtual frame
+    uint64_t frames; // Presented frames
+};
+
+#endif
@@ -0,0 +1,495 @@
+#include "chip8.h"
+
+// Compiles hot blocks to x86-64. The leading run of supported instructions in a
+// block becomes one native function, the rest of the block and everything the
+// compiler does not handle (DXYN, FX0A, calls, stores, ...) keeps running as
+// micro-ops. Stores that overwrite a block drop its native code with it.
+//
+// Native code is called with the address of V in rdi, every other field is
+// reached at a fixed offset from it. The V registers a block uses are loaded
+// into host registers on entry and I lives in edx, all of them are written
+// back before returning.
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+
+#include <sys/mman.h>
+
+static constexpr size_t CODE_BUFFER_SIZE = 1 << 20;
+static constexpr size_t MAX_COMPILED_SIZE = 4096; // Worst case for one 64 instruction block is well below this
+
+struct Chip8::CodeBuffer {
+    uint8_t* base;
+    size_t used;
+
+    CodeBuffer() : used(0) {
+        void* mapped = mmap(nullptr, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        base = (mapped == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(mapped);
+    }
+
+    ~CodeBuffer() {
+        if (base) {
+            munmap(base, CODE_BUFFER_SIZE);
+        }
+    }
+};
+
+// Host registers, x86 encoding numbers
+static constexpr int RAX = 0;
+static constexpr int RDX = 2; // I
+static constexpr int RDI = 7; // Address of V
+
+// Registers handed out to V, caller saved first
+static constexpr int HOST_REGISTERS[] = {1, 6, 8, 9, 10, 11, 3, 5, 12, 13, 14, 15};
+static constexpr int CALLER_SAVED = 6;
+
+namespace {
+
+class Assembler {
+    public:
+    std::vector<uint8_t> code;
+
+    void byte(uint8_t value) {
+        code.push_back(value);
+    }
+
+    void word(uint16_t value) {
+        byte(value & 0xFF);
+        byte(value >> 8);
+    }
+
+    void dword(uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            byte((value >> (8 * i)) & 0xFF);
+        }
+    }
+
+    // REX prefix, always emitted for byte registers so sil/bpl are reachable
+    void rex(int reg, int rm) {
+        byte(0x40 | ((reg >> 3) << 2) | (rm >> 3));
+    }
+
+    void modrm_reg(int reg, int rm) {
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void modrm_state(int reg, int32_t offset) { // [rdi + offset]
+        byte(0x80 | ((reg & 7) << 3) | RDI);
+        dword(offset);
+    }
+
+    // reg8 <- [rdi + offset]
+    void load8(int reg, int32_t offset) {
+        rex(reg, 0);
+        byte(0x8A);
+        modrm_state(reg, offset);
+    }
+
+    // [rdi + offset] <- reg8
+    void store8(int32_t offset, int reg) {
+        rex(reg, 0);
+        byte(0x88);
+        modrm_state(reg, offset);
+    }
+
+    void mov8_imm(int reg, uint8_t value) {
+        rex(0, reg);
+        byte(0xB0 + (reg & 7));
+        byte(value);
+    }
+
+    // 0x80 group: /0 add, /7 cmp
+    void alu8_imm(int extension, int reg, uint8_t value) {
+        rex(0, reg);
+        byte(0x80);
+        modrm_reg(extension, reg);
+        byte(value);
+    }
+
+    // dst8 <op>= src8, op is the r/m8, r8 opcode: 0x00 add, 0x08 or, 0x20 and, 0x28 sub, 0x30 xor, 0x38 cmp, 0x88 mov
+    void alu8(uint8_t opcode, int dst, int src) {
+        rex(src, dst);
+        byte(opcode);
+        modrm_reg(src, dst);
+    }
+
+    // 0xD0 group: /4 shl, /5 shr
+    void shift8(int extension, int reg) {
+        rex(0, reg);
+        byte(0xD0);
+        modrm_reg(extension, reg);
+    }
+
+    // setcc reg8, condition is the low nibble of the 0x0F 0x9X opcode
+    void setcc(uint8_t condition, int reg) {
+        rex(0, reg);
+        byte(0x0F);
+        byte(0x90 | condition);
+        modrm_reg(0, reg);
+    }
+
+    // eax <- zero extended reg8
+    void movzx_eax(int reg) {
+        rex(RAX, reg);
+        byte(0x0F);
+        byte(0xB6);
+        modrm_reg(RAX, reg);
+    }
+
+    // [rdi + offset] <- imm16
+    void store16_imm(int32_t offset, uint16_t value) {
+        byte(0x66);
+        byte(0xC7);
+        modrm_state(0, offset);
+        word(value);
+    }
+
+    void push(int reg) {
+        if (reg >= 8) {
+            byte(0x41);
+        }
+        byte(0x50 + (reg & 7));
+    }
+
+    void pop(int reg) {
+        if (reg >= 8) {
+            byte(0x41);
+        }
+        byte(0x58 + (reg & 7));
+    }
+};
+
+// Instructions the compiler can translate
+bool supported(uint16_t instruction) {
+    switch (instruction >> 12) {
+        case 0x1: case 0x3: case 0x4: case 0x6: case 0x7: case 0xA: case 0xB:
+            return true;
+        case 0x5: case 0x9:
+            return (instruction & 0xF) == 0x0;
+        case 0x8:
+            return (instruction & 0xF) <= 0x7 || (instruction & 0xF) == 0xE;
+        case 0xE:
+            return (instruction & 0xFF) == 0x9E || (instruction & 0xFF) == 0xA1;
+        case 0xF:
+            switch (instruction & 0xFF) {
+                case 0x07: case 0x15: case 0x18: case 0x1E: case 0x29: case 0x30:
+                    return true;
+                default:
+                    return false;
+            }
+        default:
+            return false;
+    }
+}
+
+}
+
+bool Chip8::jit_compile(Block& block) {
+    // Leading instructions of the block the compiler understands
+    uint32_t length = 0;
+    uint16_t used = 0; // Bit per V register the block touches
+    while (length < block.length) {
+        uint16_t address = block.start + 2 * length;
+        uint16_t instruction = memory[address] << 8 | memory[address + 1];
+        if (!supported(instruction)) {
+            break;
+        }
+        ++length;
+
+        int x = (instruction >> 8) & 0xF;
+        int y = (instruction >> 4) & 0xF;
+        switch (instruction >> 12) {
+            case 0x1: case 0xA:
+                break;
+            case 0x5: case 0x9:
+                used |= (1 << x) | (1 << y);
+                break;
+            case 0x8:
+                used |= (1 << x) | (1 << y) | (1 << 15);
+                break;
+            case 0xB:
+                used |= (quirks & JUMP_VX) ? (1 << x) : 1;
+                break;
+            case 0xF:
+                used |= (1 << x) | (1 << 15);
+                break;
+            default:
+                used |= 1 << x;
+                break;
+        }
+    }
+
+    if (length == 0) {
+        return false;
+    }
+
+    if (!jit_code.buffer) {
+        jit_code.buffer = std::make_shared<CodeBuffer>();
+    }
+    CodeBuffer& buffer = *jit_code.buffer;
+    if (!buffer.base) {
+        return false;
+    }
+    if (buffer.used + MAX_COMPILED_SIZE > CODE_BUFFER_SIZE) {
+        recycle_blocks(); // Also resets the code buffer, the caller looks the block up again
+        return false;
+    }
+
+    // Offsets of the state the native code reaches through rdi
+    auto offset = [this](const void* field) {
+        return static_cast<int32_t>(reinterpret_cast<intptr_t>(field) - reinterpret_cast<intptr_t>(V));
+    };
+    const int32_t I_offset = offset(&I);
+    const int32_t PC_offset = offset(&PC);
+    const int32_t delay_offset = offset(&delay_countdown);
+    const int32_t sound_offset = offset(&sound_countdown);
+    const int32_t keypad_offset = offset(&keypad);
+
+    int host[16];
+    int assigned = 0;
+    for (int v = 0; v < 16; ++v) {
+        host[v] = -1;
+        if (used & (1 << v)) {
+            if (assigned == static_cast<int>(sizeof(HOST_REGISTERS) / sizeof(HOST_REGISTERS[0]))) {
+                return false; // Too many registers for one block, stays on micro-ops
+            }
+            host[v] = HOST_REGISTERS[assigned++];
+        }
+    }
+
+    Assembler a;
+
+    // Prologue
+    for (int i = CALLER_SAVED; i < assigned; ++i) {
+        a.push(HOST_REGISTERS[i]);
+    }
+    for (int v = 0; v < 16; ++v) {
+        if (host[v] >= 0) {
+            a.load8(host[v], v);
+        }
+    }
+    a.byte(0x0F); a.byte(0xB7); a.modrm_state(RDX, I_offset); // movzx edx, word [I]
+
+    auto write_back = [&]() {
+        for (int v = 0; v < 16; ++v) {
+            if (host[v] >= 0) {
+                a.store8(v, host[v]);
+            }
+        }
+        a.byte(0x66); a.byte(0x89); a.modrm_state(RDX, I_offset); // mov [I], dx
+    };
+
+    // Sets PC to taken when the flags match condition, otherwise to the next instruction
+    auto skip = [&](uint8_t jump_if_not_taken, uint16_t next) {
+        a.store16_imm(PC_offset, next);
+        a.byte(jump_if_not_taken);
+        a.byte(9); // Size of the store below
+        a.store16_imm(PC_offset, next + 2);
+    };
+
+    bool pc_written = false;
+    const int F = host[15];
+
+    for (uint32_t i = 0; i < length; ++i) {
+        uint16_t address = block.start + 2 * i;
+        uint16_t instruction = memory[address] << 8 | memory[address + 1];
+        uint16_t next = address + 2;
+        int x = (instruction >> 8) & 0xF;
+        int y = (instruction >> 4) & 0xF;
+        uint8_t nn = instruction & 0xFF;
+        uint16_t nnn = instruction & 0xFFF;
+        int X = host[x];
+        int Y = host[y];
+
+        switch (instruction >> 12) {
+            case 0x1: { // Jump
+                write_back();
+                a.store16_imm(PC_offset, nnn);
+                pc_written = true;
+                break;
+            }
+
+            case 0x3: {
+                write_back();
+                a.alu8_imm(7, X, nn);
+                skip(0x75, next); // jne
+                pc_written = true;
+                break;
+            }
+
+            case 0x4: {
+                write_back();
+                a.alu8_imm(7, X, nn);
+                skip(0x74, next); // je
+                pc_written = true;
+                break;
+            }
+
+            case 0x5: {
+                write_back();
+                a.alu8(0x38, X, Y);
+                skip(0x75, next);
+                pc_written = true;
+                break;
+            }
+
+            case 0x9: {
+                write_back();
+                a.alu8(0x38, X, Y);
+                skip(0x74, next);
+                pc_written = true;
+                break;
+            }
+
+            case 0x6: {
+                a.mov8_imm(X, nn);
+                break;
+            }
+
+            case 0x7: {
+                a.alu8_imm(0, X, nn);
+                break;
+            }
+
+            case 0x8: {
+                switch (instruction & 0xF) {
+                    case 0x0: a.alu8(0x88, X, Y); break;
+                    case 0x1: case 0x2: case 0x3: {
+                        static constexpr uint8_t logic[] = {0x08, 0x20, 0x30};
+                        a.alu8(logic[(instruction & 0xF) - 1], X, Y);
+                        if (quirks & VF_RESET) {
+                            a.mov8_imm(F, 0);
+                        }
+                        break;
+                    }
+                    case 0x4: { // VF is the carry
+                        a.alu8(0x00, X, Y);
+                        a.setcc(0x2, F);
+                        break;
+                    }
+                    case 0x5: { // VF is not borrow
+                        a.alu8(0x28, X, Y);
+                        a.setcc(0x3, F);
+                        break;
+                    }
+                    case 0x7: {
+                        a.alu8(0x88, RAX, Y);
+                        a.alu8(0x28, RAX, X);
+                        a.alu8(0x88, X, RAX); // mov keeps the flags
+                        a.setcc(0x3, F);
+                        break;
+                    }
+                    case 0x6: case 0xE: { // Shifted out bit lands in the carry
+                        if ((quirks & SHIFT_VY) && x != y) {
+                            a.alu8(0x88, X, Y);
+                        }
+                        a.shift8((instruction & 0xF) == 0x6 ? 5 : 4, X);
+                        a.setcc(0x2, F);
+                        break;
+                    }
+                }
+                break;
+            }
+
+            case 0xA: {
+                a.byte(0xBA); a.dword(nnn); // mov edx, nnn
+                break;
+            }
+
+            case 0xB: { // Jump with offset
+                write_back();
+                a.movzx_eax((quirks & JUMP_VX) ? X : host[0]);
+                a.byte(0x05); a.dword(nnn); // add eax, nnn
+                a.byte(0x66); a.byte(0x89); a.modrm_state(RAX, PC_offset); // mov [PC], ax
+                pc_written = true;
+                break;
+            }
+
+            case 0xE: { // Key skips
+                write_back();
+                a.movzx_eax(X);
+                a.byte(0x83); a.byte(0xE0); a.byte(0x0F); // and eax, 15
+                a.byte(0x66); a.byte(0x0F); a.byte(0xA3); a.modrm_state(RAX, keypad_offset); // bt word [rdi + keypad], ax
+                skip(nn == 0x9E ? 0x73 : 0x72, next); // jnc or jc past the skip
+                pc_written = true;
+                break;
+            }
+
+            case 0xF: {
+                switch (nn) {
+                    case 0x07: a.load8(X, delay_offset); break;
+                    case 0x15: a.store8(delay_offset, X); break;
+                    case 0x18: a.store8(sound_offset, X); break;
+                    case 0x1E: { // I += VX, VF follows the interpreter's VX + I > 255
+                        a.movzx_eax(X);
+                        a.byte(0x66); a.byte(0x01); a.modrm_reg(RAX, RDX); // add dx, ax
+                        a.byte(0x0F); a.byte(0xB7); a.modrm_reg(RDX, RDX); // movzx edx, dx
+                        a.byte(0x01); a.modrm_reg(RDX, RAX); // add eax, edx
+                        a.byte(0x3D); a.dword(255); // cmp eax, 255
+                        a.setcc(0x7, F); // seta
+                        break;
+                    }
+                    case 0x29: { // I = 0x050 + digit * 5
+                        a.movzx_eax(X);
+                        a.byte(0x83); a.byte(0xE0); a.byte(0x0F);
+                        a.byte(0x8D); a.byte(0x54); a.byte(0x80); a.byte(0x50); // lea edx, [rax + rax * 4 + 0x50]
+                        break;
+                    }
+                    case 0x30: { // I = 0x0A0 + digit * 10
+                        a.movzx_eax(X);
+                        a.byte(0x83); a.byte(0xE0); a.byte(0x0F);
+                        a.byte(0x8D); a.byte(0x04); a.byte(0x80); // lea eax, [rax + rax * 4]
+                        a.byte(0x8D); a.byte(0x94); a.byte(0x00); a.dword(0x0A0); // lea edx, [rax + rax + 0xA0]
+                        break;
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    // Epilogue
+    if (!pc_written) {
+        write_back();
+        a.store16_imm(PC_offset, block.start + 2 * length);
+    }
+    for (int i = assigned - 1; i >= CALLER_SAVED; --i) {
+        a.pop(HOST_REGISTERS[i]);
+    }
+    a.byte(0xC3); // ret
+
+    // Copy into the buffer, writable and executable are never set together. No other machine runs from it
+    uint8_t* code = buffer.base + buffer.used;
+    if (mprotect(buffer.base, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    memcpy(code, a.code.data(), a.code.size());
+    buffer.used += (a.code.size() + 15) & ~static_cast<size_t>(15);
+    if (mprotect(buffer.base, CODE_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        return false;
+    }
+
+    block.compiled = reinterpret_cast<NativeCode>(code);
+    block.compiled_length = length;
+    return true;
+}
+
+void Chip8::jit_reset() {
+    // Only called through recycle_blocks, no block points into the buffer any more
+    if (jit_code.buffer) {
+        jit_code.buffer->used = 0;
+    }
+}
+
+#else
+
+struct Chip8::CodeBuffer {
+};
+
+bool Chip8::jit_compile(Block&) {
+    return false; // No native backend on this host, JIT mode runs as the block cache
+}
+
+void Chip8::jit_reset() {
+}
+
+#endif
@@ -1,33 +1,111 @@
-#include "chip8.h"
+#include "frontend.h"
+#include "replay.h"
+#include "rewind.h"
+#include "quirks.h"
 #include <cstdio>
+#include <thread>
+#include <bit>
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--turbo] [--record file] [--keys file] [--quirks file] [--audio-buffer samples]\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    // --turbo runs as fast as the host allows, timers still tick once per 60 Hz worth of instructions
+    // --record writes every keypad change to a replay file, chip8-bench -r plays it back headlessly
+    // --audio-buffer sets the audio callback size in samples, smaller is lower latency
+    // --keys loads a key map, otherwise <rom>.keys is used when it exists
+    // --quirks adds quirk profiles to the built-in ones, the ROM's hash picks its quirks when it loads
+    bool turbo = false;
+    std::string record_path;
+    std::string keys_path;
+    int audio_buffer = 256; // About 6 ms at 44.1 kHz
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--turbo") {
+            turbo = true;
+        }
+        else if (arg == "--record" && i + 1 < argc) {
+            record_path = argv[++i];
+        }
+        else if (arg == "--quirks" && i + 1 < argc) {
+            try {
+                load_quirk_profiles(argv[++i]);
+            }
+            catch (const std::exception& e) {
+                fprintf(stderr, "%s: %s\n", argv[i], e.what());
+                return -1;
+            }
+        }
+        else if (arg == "--keys" && i + 1 < argc) {
+            keys_path = argv[++i];
+        }
+        else if (arg == "--audio-buffer" && i + 1 < argc) {
+            audio_buffer = std::atoi(argv[++i]);
+            if (audio_buffer < 128 || audio_buffer > 8192 || !std::has_single_bit(static_cast<unsigned>(audio_buffer))) {
+                fprintf(stderr, "--audio-buffer takes a power of two from 128 to 8192\n");
+                return -1;
+            }
+        }
+        else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            usage(argv[0]);
+            return -1;
+        }
+    }
 
-int main() {
-    uint32_t time_accumulated = 0;
-    uint32_t cpu_time_accumulated = 0;
-
-    uint32_t delta;
-
-    uint32_t last_time = 0;
-    uint32_t cpu_last_time = 0;
-
-    uint32_t now;
-    const double tick = 1000.0 / 60.0; // in ms
-
-    SDL_Event event;
     bool SDL_running = true;
 
     // Get chip type and ROM
     int chip;
-    std::cout << "Enter 1 for CHIP8 or 2 for SUPER_CHIP: ";
-    std::cin >> chip;
+    std::cout << "Enter 1 for CHIP8, 2 for SUPER_CHIP or 3 for SUPER_CHIP legacy (SCHIP 1.1): ";
+    if (!(std::cin >> chip) || chip < Chip8::CHIP_8 || chip > Chip8::SUPER_CHIP_LEGACY) {
+        fprintf(stderr, "The chip type has to be 1, 2 or 3\n");
+        return -1;
+    }
 
-    const double cpu_tick = (chip == 1) ? 1000.0 / 600.0 : 1000.0 / 6000.0;
+    const int cycles_per_frame = Chip8::cycles_per_frame(chip);
 
     std::string path;
     std::cout << "Enter the path of the ROM: ";
     std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n'); // Ignore previous cin newline
     std::getline(std::cin, path);
 
+    KeyMap keys;
+    if (keys_path.empty() && std::ifstream(path + ".keys")) { // Per ROM layout next to it
+        keys_path = path + ".keys";
+    }
+    if (!keys_path.empty()) {
+        try {
+            keys.load(keys_path);
+        }
+        catch (const std::exception& e) {
+            fprintf(stderr, "%s: %s\n", keys_path.c_str(), e.what());
+            return -1;
+        }
+    }
+
+    // Loaded before any window opens, a bad ROM or replay path ends here
+    Chip8 emulator{chip};
+    try {
+        emulator.load_game(path);
+    }
+    catch (const std::exception& e) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), e.what());
+        return -1;
+    }
+
+    std::unique_ptr<Recorder> recorder;
+    if (!record_path.empty()) { // The seed the emulator started with makes CXNN replay too
+        try {
+            recorder = std::make_unique<Recorder>(record_path, chip, emulator.get_quirks(), cycles_per_frame, emulator.get_seed(), rom_hash(path));
+        }
+        catch (const std::exception& e) {
+            fprintf(stderr, "%s: %s\n", record_path.c_str(), e.what());
+            return -1;
+        }
+    }
+
     // Display stuff
     SDL_Window* window = nullptr;
     SDL_Renderer* renderer = nullptr;
@@ -48,89 +126,113 @@ int main() {
             return -1;
         }
     }
-    
-    SDL_RenderSetScale(renderer, SCALE, SCALE);
+
+    Renderer screen{renderer};
 
     // Clear screen
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // RGBA
     SDL_RenderClear(renderer);
     SDL_RenderPresent(renderer);
 
-    // Audio
-    bool sound_on = false;
-
-    SDL_AudioSpec spec;
-    spec.freq = 44100;
-    spec.format = AUDIO_S16SYS;
-    spec.channels = 1;
-    spec.samples = 512; // Can determine latency
-    spec.callback = NULL;
-    SDL_AudioDeviceID device_id = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0);
-
-    Sint16 samples[735]; // Lasts one cycle of decrementing sound countdown
-    samples[734] = 20000;
-    for (int i = 1; i < 735; i = i + 2) { // Needs to be square wave
-        samples[i] = -5000;
-        samples[i-1] = 5000;
-    }
+    Audio audio{audio_buffer};
 
-    Chip8 emulator{chip}; 
-    emulator.load_game(path);
-    
-    while (emulator.is_running() && SDL_running) { // Make sure SDL and emulator are both on
-        // --- Get inputs ---
-        SDL_running = emulator.poll(event);
-
-        // --- Audio ---
-        // Turn on audio
-        if (!sound_on && emulator.get_sound_countdown() > 0) {
-            SDL_ClearQueuedAudio(device_id); 
-            sound_on = true;
-            SDL_QueueAudio(device_id, samples, sizeof(samples));
-            SDL_PauseAudioDevice(device_id, 0);
-        }
-        // Turn off audio
-        else if (sound_on && emulator.get_sound_countdown() == 0) {
-            SDL_ClearQueuedAudio(device_id);
-            sound_on = false;
-            SDL_PauseAudioDevice(device_id, 1);
-        }    
-
-        // --- CPU Cycle ---
-        now = SDL_GetTicks(); 
-        delta = now - cpu_last_time;
-        cpu_time_accumulated += delta;
-        cpu_last_time = now;
-
-        while (cpu_time_accumulated >= cpu_tick) {
-            emulator.cycle(); 
-            cpu_time_accumulated -= cpu_tick;
-        }
+    uint64_t executed = 0;
+
+    Rewind history; // About ten minutes of frames
+
+    // Only these cross threads, the emulator itself belongs to the emulation thread until it is joined
+    FrameExchange frames;
+    std::atomic<uint16_t> keypad{0}; // Bit n is key n, written by poll
+    std::atomic<bool> rewinding{false}; // Backspace held
+    std::atomic<bool> quit{false}; // Window closed
+    std::atomic<bool> stopped{false}; // Emulator stopped
+
+    // Emulation runs on its own thread so a slow present or a vsync stall never delays it
+    Scheduler scheduler{60.0};
+    std::thread emulation([&] {
+        Throughput throughput;
+        uint64_t virtual_time = 0; // Virtual frames run or rewound, the audio clock
 
-        // Get timing right
-        now = SDL_GetTicks(); 
-        delta = now - last_time;
-        time_accumulated += delta;
-        last_time = now;
-
-        while (time_accumulated >= tick) { // Counts down at 60 Hz
-            // --- Timers ---
-            if (emulator.get_delay_countdown() > 0)
-                emulator.decrement_delay_countdown();
-            if (emulator.get_sound_countdown() > 0) {
-                emulator.decrement_sound_countdown();             
+        while (emulator.is_running() && !quit.load(std::memory_order_relaxed)) {
+            // --- Inputs, latched once per frame ---
+            emulator.set_keypad(keypad.load(std::memory_order_relaxed));
+            if (recorder) {
+                recorder->record(executed, emulator.get_keypad());
+            }
+
+            // --- CPU Cycle and timers ---
+            // One virtual frame normally, as many as fit in the real frame in turbo mode
+            uint64_t instructions = 0;
+            uint64_t virtual_frames = 0;
+
+            // Holding backspace steps back a frame per frame instead, not while recording since replays only go forward
+            if (!recorder && rewinding.load(std::memory_order_relaxed)) {
+                uint16_t keys = emulator.get_keypad(); // Keys held now, not the ones in the old state
+                history.rewind(emulator, 1);
+                emulator.set_keypad(keys);
+                emulator.set_display_changed(true);
+                audio.tone(virtual_time++, false); // Silent while rewinding
+            }
+            else {
+                do {
+                    instructions += emulator.run(cycles_per_frame);
+                    ++virtual_frames;
+                    audio.tone(virtual_time++, emulator.get_sound_countdown() > 0); // Beeps for every frame that ends with the sound timer set
+                    emulator.tick_timers(); // Counts down every virtual frame
+                } while (turbo && emulator.is_running() && !scheduler.expired());
+
+                history.push(emulator);
             }
-            
+            executed += instructions;
+
             // --- Display ---
-            if (emulator.get_display_changed()) { // Only presents when necessary
-                emulator.display(renderer);
+            if (emulator.get_display_changed()) { // Only publishes when necessary
+                frames.publish(emulator);
                 emulator.set_display_changed(false);
             }
-                     
-            time_accumulated -= tick;
+
+            if (turbo) {
+                scheduler.restart();
+                throughput.add(instructions, virtual_frames);
+                throughput.report(stderr);
+            }
+            else {
+                scheduler.wait(); // Sleeps for the rest of the frame
+            }
+        }
+        stopped.store(true, std::memory_order_relaxed);
+    });
+
+    // This thread only handles SDL: events and presenting the newest frame, audio runs from its own callback
+    Scheduler presentation{60.0};
+    while (SDL_running && !stopped.load(std::memory_order_relaxed)) {
+        // --- Get inputs ---
+        SDL_running = poll(keys, keypad);
+        rewinding.store(SDL_GetKeyboardState(nullptr)[SDL_SCANCODE_BACKSPACE] != 0, std::memory_order_relaxed);
+
+        // --- Display ---
+        if (const Frame* frame = frames.take()) {
+            screen.display(*frame);
         }
-        
+
+        presentation.wait();
+    }
+    quit.store(true, std::memory_order_relaxed);
+    emulation.join();
+
+    scheduler.report(stderr);
+    if (emulator.write_profile("chip8-profile")) { // Profiling builds only
+        fprintf(stderr, "Profile written to chip8-profile.txt and chip8-profile.folded\n");
     }
+    if (emulator.get_fault() != Chip8::NO_FAULT) {
+        fprintf(stderr, "Stopped at %03X: %s\n", emulator.get_pc(), Chip8::fault_name(emulator.get_fault()));
+    }
+    if (recorder) {
+        recorder->finish(executed);
+    }
+
+    audio.close();
+    SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
 
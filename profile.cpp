@@ -0,0 +1,122 @@
+#include "profile.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+static const char* FAMILY_NAMES[16] = {
+    "0NNN system", "1NNN jump", "2NNN call", "3XNN skip", "4XNN skip", "5XY0 skip", "6XNN load", "7XNN add",
+    "8XYN alu", "9XY0 skip", "ANNN index", "BNNN jump", "CXNN random", "DXYN draw", "EXNN key skip", "FXNN misc"
+};
+
+Profiler::Profiler() {
+    // Calibrates the time an empty begin/end pair measures, one clock read, the cheapest of a few rounds
+    overhead = 1e9;
+    for (int round = 0; round < 8; ++round) {
+        auto first = std::chrono::steady_clock::now();
+        for (int i = 0; i < 1000; ++i) {
+            begin();
+            std::chrono::steady_clock::now();
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - first;
+        overhead = std::min(overhead, elapsed.count() / 2000); // Two reads per iteration
+    }
+    clear();
+}
+
+void Profiler::clear() {
+    memset(address_counts, 0, sizeof(address_counts));
+    memset(family_counts, 0, sizeof(family_counts));
+    memset(family_ns, 0, sizeof(family_ns));
+    nodes.assign(1, {0x200, 0, 0});
+    children.clear();
+    current = 0;
+}
+
+void Profiler::enter(uint16_t address) {
+    uint64_t key = static_cast<uint64_t>(current) << 16 | address;
+    auto child = children.find(key);
+    if (child == children.end()) {
+        nodes.push_back({address, current, 0});
+        child = children.emplace(key, nodes.size() - 1).first;
+    }
+    current = child->second;
+}
+
+void Profiler::leave() {
+    current = nodes[current].parent; // The root is its own parent
+}
+
+std::string Profiler::path(uint32_t node) const {
+    std::vector<uint16_t> frames;
+    for (uint32_t n = node; n != 0; n = nodes[n].parent) {
+        frames.push_back(nodes[n].address);
+    }
+
+    std::string result = "main";
+    char frame[16];
+    for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+        snprintf(frame, sizeof(frame), ";sub_%03X", *it);
+        result += frame;
+    }
+    return result;
+}
+
+bool Profiler::write(const std::string& prefix, const uint8_t* memory) const {
+    FILE* report = fopen((prefix + ".txt").c_str(), "w");
+    if (!report) {
+        return false;
+    }
+
+    uint64_t total = 0;
+    for (uint64_t count : family_counts) {
+        total += count;
+    }
+
+    // Families, most executed first
+    int families[16];
+    for (int f = 0; f < 16; ++f) {
+        families[f] = f;
+    }
+    std::sort(families, families + 16, [&](int a, int b) { return family_counts[a] > family_counts[b]; });
+
+    fprintf(report, "%llu instructions, %.1f ns of timer overhead taken off each\n\n", static_cast<unsigned long long>(total), overhead);
+    fprintf(report, "%-16s %14s %7s %14s %9s\n", "family", "count", "%", "raw host ns", "ns/instr");
+    for (int f : families) {
+        if (family_counts[f] == 0) {
+            break;
+        }
+        fprintf(report, "%-16s %14llu %6.2f%% %14llu %9.2f\n", FAMILY_NAMES[f],
+            static_cast<unsigned long long>(family_counts[f]), 100.0 * family_counts[f] / total,
+            static_cast<unsigned long long>(family_ns[f]), std::max(0.0, static_cast<double>(family_ns[f]) / family_counts[f] - overhead));
+    }
+
+    // Addresses, most executed first, with what is in memory there now
+    std::vector<uint16_t> addresses;
+    for (int a = 0; a < 0x1000; ++a) {
+        if (address_counts[a]) {
+            addresses.push_back(a);
+        }
+    }
+    std::sort(addresses.begin(), addresses.end(), [&](uint16_t a, uint16_t b) { return address_counts[a] > address_counts[b]; });
+
+    fprintf(report, "\n%-8s %-6s %14s %7s\n", "address", "opcode", "count", "%");
+    for (uint16_t a : addresses) {
+        uint16_t opcode = memory[a] << 8 | memory[(a + 1) & 0xFFF];
+        fprintf(report, "%03X      %04X   %14llu %6.2f%%\n", a, opcode,
+            static_cast<unsigned long long>(address_counts[a]), 100.0 * address_counts[a] / total);
+    }
+    fclose(report);
+
+    // One line per call path, "main;sub_2A0;sub_300 samples", the input flamegraph.pl expects
+    FILE* folded = fopen((prefix + ".folded").c_str(), "w");
+    if (!folded) {
+        return false;
+    }
+    for (uint32_t n = 0; n < nodes.size(); ++n) {
+        if (nodes[n].samples) {
+            fprintf(folded, "%s %llu\n", path(n).c_str(), static_cast<unsigned long long>(nodes[n].samples));
+        }
+    }
+    fclose(folded);
+    return true;
+}
@@ -0,0 +1,63 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+
+// Instruction profiler, only compiled in with -DCHIP8_PROFILE (make PROFILE=1).
+// Counts executions per address and per opcode family, host time per family, and samples per call path
+// following 2NNN/00EE so the output can be turned into a flame graph.
+class Profiler {
+  public:
+    Profiler();
+
+    void begin() {
+        start = std::chrono::steady_clock::now();
+    }
+
+    void end(uint16_t address, uint16_t instruction, int depth_change, uint16_t target) {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        int family = instruction >> 12;
+
+        ++address_counts[address & 0xFFF];
+        ++family_counts[family];
+        family_ns[family] += ns;
+        ++nodes[current].samples; // Charged to the routine it ran in
+
+        if (depth_change > 0) {
+            enter(target);
+        }
+        else if (depth_change < 0) {
+            leave();
+        }
+    }
+
+    void clear();
+    bool write(const std::string& prefix, const uint8_t* memory) const; // prefix.txt report, prefix.folded collapsed stacks
+
+  private:
+    struct Node {
+        uint16_t address; // Routine entry, 0x200 for the root
+        uint32_t parent;
+        uint64_t samples;
+    };
+
+    void enter(uint16_t address);
+    void leave();
+    std::string path(uint32_t node) const;
+
+    std::chrono::steady_clock::time_point start;
+    double overhead; // ns a clock read adds to every measured instruction, taken off in the report
+    uint64_t address_counts[0x1000];
+    uint64_t family_counts[16];
+    uint64_t family_ns[16];
+
+    std::vector<Node> nodes; // Call path trie, node 0 is the root
+    std::unordered_map<uint64_t, uint32_t> children; // parent << 16 | address
+    uint32_t current;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#include "quirks.h"
+#include "chip8.h"
+#include <sstream>
+
+// Built-in entries, add a ROM once its hash and behaviour have been checked against the file and the original interpreter
+static std::vector<QuirkProfile> profiles = {
+};
+
+static const struct {
+    const char* name;
+    int flag;
+} QUIRK_NAMES[] = {
+    {"vf_reset", Chip8::VF_RESET},
+    {"shift_vy", Chip8::SHIFT_VY},
+    {"jump_vx", Chip8::JUMP_VX},
+    {"memory_increment", Chip8::MEMORY_INCREMENT},
+};
+
+const QuirkProfile* find_quirk_profile(uint64_t hash) {
+    for (const QuirkProfile& profile : profiles) {
+        if (profile.hash == hash) {
+            return &profile;
+        }
+    }
+    return nullptr;
+}
+
+int parse_quirks(const std::string& list) {
+    if (list == "none") {
+        return 0;
+    }
+
+    int flags = 0;
+    std::stringstream names(list);
+    std::string name;
+    while (std::getline(names, name, ',')) {
+        bool known = false;
+        for (const auto& quirk : QUIRK_NAMES) {
+            if (name == quirk.name) {
+                flags |= quirk.flag;
+                known = true;
+            }
+        }
+        if (!known) {
+            throw std::runtime_error("Unknown quirk " + name);
+        }
+    }
+    return flags;
+}
+
+std::string quirk_names(int flags) {
+    std::string list;
+    for (const auto& quirk : QUIRK_NAMES) {
+        if (flags & quirk.flag) {
+            list += (list.empty() ? "" : ",") + std::string(quirk.name);
+        }
+    }
+    return list.empty() ? "none" : list;
+}
+
+void load_quirk_profiles(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Failed to open quirk profiles");
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::stringstream fields(line.substr(0, line.find('#')));
+        std::string hash;
+        std::string quirks;
+        if (!(fields >> hash)) {
+            continue; // Blank or comment
+        }
+        if (hash.size() != 16 || hash.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos || !(fields >> quirks)) {
+            throw std::runtime_error("Bad quirk profile line: " + line);
+        }
+
+        QuirkProfile profile{std::stoull(hash, nullptr, 16), parse_quirks(quirks), ""};
+        std::getline(fields >> std::ws, profile.name);
+        profiles.push_back(profile);
+    }
+}
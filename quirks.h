@@ -0,0 +1,25 @@
+#ifndef QUIRKS_H
+#define QUIRKS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// ROMs that need other quirks than their chip type's default, keyed by fnv1a() of the file (rom_hash() in replay.h).
+// load_rom() looks every ROM up here. The built-in list ships empty: an entry needs the ROM's hash checked against
+// the actual file, so known games come from profile files, which add to the list, one ROM per line:
+//   hash quirks name
+// hash is 16 hex digits, quirks is a comma separated list of vf_reset, shift_vy, jump_vx, memory_increment or none,
+// # starts a comment
+struct QuirkProfile {
+    uint64_t hash;
+    int quirks; // Chip8::VF_RESET | ...
+    std::string name;
+};
+
+const QuirkProfile* find_quirk_profile(uint64_t hash); // nullptr when the ROM is not listed
+void load_quirk_profiles(const std::string& path); // Throws on a bad line. Call before emulators run on other threads
+int parse_quirks(const std::string& list); // "vf_reset,shift_vy" to flags, throws on an unknown name
+std::string quirk_names(int flags); // The other way round, "none" for 0
+
+#endif
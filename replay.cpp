@@ -0,0 +1,132 @@
+#include "replay.h"
+#include "rom_cache.h"
+#include <algorithm>
+
+static const char MAGIC[4] = {'C', '8', 'R', 'P'};
+static constexpr uint8_t VERSION = 2; // 2 added the quirks
+
+static void put(std::ofstream& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out.put(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+static uint64_t get(std::ifstream& in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        int byte = in.get();
+        if (byte == EOF) {
+            throw std::runtime_error("Replay file is truncated");
+        }
+        value |= static_cast<uint64_t>(byte) << (8 * i);
+    }
+    return value;
+}
+
+uint64_t rom_hash(const std::string& path) {
+    return RomImage(path).hash();
+}
+
+Recorder::Recorder(const std::string& path, int chip, int quirks, int cycles_per_frame, uint64_t seed, uint64_t rom)
+    : out(path, std::ios::binary), last_cycle(0), last_keys(0) {
+    if (!out) {
+        throw std::runtime_error("Failed to create replay file");
+    }
+
+    out.write(MAGIC, sizeof(MAGIC));
+    put(out, VERSION, 1);
+    put(out, chip, 1);
+    put(out, quirks, 1);
+    put(out, cycles_per_frame, 2);
+    put(out, seed, 8);
+    put(out, rom, 8);
+}
+
+void Recorder::record(uint64_t cycle, uint16_t keys) {
+    if (keys != last_keys) {
+        write(cycle, keys);
+    }
+}
+
+void Recorder::finish(uint64_t cycle) {
+    write(cycle, last_keys);
+    out.flush();
+}
+
+void Recorder::write(uint64_t cycle, uint16_t keys) {
+    uint64_t delta = cycle - last_cycle;
+    do { // LEB128, changes are usually a few frames apart so this is one or two bytes
+        uint8_t byte = delta & 0x7F;
+        delta >>= 7;
+        out.put(static_cast<char>(delta ? (byte | 0x80) : byte));
+    } while (delta);
+    put(out, keys, 2);
+
+    last_cycle = cycle;
+    last_keys = keys;
+}
+
+uint64_t Replay::length() const {
+    return events.empty() ? 0 : events.back().cycle;
+}
+
+Replay load_replay(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Failed to open replay file");
+    }
+
+    char magic[4];
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw std::runtime_error("Not a replay file");
+    }
+    if (get(in, 1) != VERSION) {
+        throw std::runtime_error("Unsupported replay version");
+    }
+
+    Replay replay;
+    replay.chip = get(in, 1);
+    replay.quirks = get(in, 1);
+    replay.cycles_per_frame = get(in, 2);
+    replay.seed = get(in, 8);
+    replay.rom = get(in, 8);
+    if (replay.cycles_per_frame == 0) {
+        throw std::runtime_error("Replay has no frame length");
+    }
+
+    uint64_t cycle = 0;
+    while (in.peek() != EOF) {
+        uint64_t delta = 0;
+        int shift = 0;
+        int byte;
+        do {
+            byte = get(in, 1);
+            delta |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            shift += 7;
+        } while ((byte & 0x80) && shift < 64);
+
+        cycle += delta;
+        replay.events.push_back({cycle, static_cast<uint16_t>(get(in, 2))});
+    }
+    return replay;
+}
+
+uint64_t play(Chip8& emulator, const Replay& replay) {
+    emulator.set_seed(replay.seed);
+    emulator.set_quirks(replay.quirks); // Whatever the profiles pick for the ROM today
+
+    uint64_t end = replay.length();
+    uint64_t executed = 0;
+    size_t next = 0;
+
+    while (executed < end && emulator.is_running()) {
+        // Keys only change between frames, as in the frontend
+        while (next < replay.events.size() && replay.events[next].cycle <= executed) {
+            emulator.set_keypad(replay.events[next++].keys);
+        }
+
+        executed += emulator.run(std::min<uint64_t>(replay.cycles_per_frame, end - executed));
+        emulator.tick_timers();
+    }
+    return executed;
+}
@@ -0,0 +1,52 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "chip8.h"
+
+// Input recordings, every keypad change is stored with the instruction count it took effect at.
+// With the quirks, the CXNN seed and the frame length in the header a replay reproduces a session exactly.
+//
+// File layout, little endian:
+//   "C8RP", version (1 byte), chip (1 byte), quirks (1 byte), cycles per frame (2 bytes), seed (8 bytes), ROM FNV-1a (8 bytes)
+//   then per change: instructions since the previous change (LEB128), keypad mask (2 bytes)
+//   the last entry repeats the keypad and marks the end of the session
+
+uint64_t rom_hash(const std::string& path); // fnv1a() of the ROM file, throws like load_game
+
+class Recorder {
+  public:
+    Recorder(const std::string& path, int chip, int quirks, int cycles_per_frame, uint64_t seed, uint64_t rom);
+
+    void record(uint64_t cycle, uint16_t keys); // Writes only when the keypad changed
+    void finish(uint64_t cycle); // Marks the end, call once after the last frame
+
+  private:
+    void write(uint64_t cycle, uint16_t keys);
+
+    std::ofstream out;
+    uint64_t last_cycle;
+    uint16_t last_keys;
+};
+
+struct Replay {
+    struct Event {
+        uint64_t cycle;
+        uint16_t keys;
+    };
+
+    int chip;
+    int quirks; // Chip8::VF_RESET | ..., as the ROM ran when recorded
+    int cycles_per_frame;
+    uint64_t seed;
+    uint64_t rom;
+    std::vector<Event> events;
+
+    uint64_t length() const; // Instructions in the session
+};
+
+Replay load_replay(const std::string& path);
+
+// Runs the session headlessly on a loaded emulator, same frame structure as the frontend, returns instructions run
+uint64_t play(Chip8& emulator, const Replay& replay);
+
+#endif
@@ -0,0 +1,177 @@
+#include "rewind.h"
+
+// Worst case for one entry: every byte a literal, plus the run headers
+static constexpr uint32_t MAX_ENTRY_SIZE = Chip8::STATE_SIZE + 16;
+
+static uint8_t* put_varint(uint8_t* out, uint32_t value) {
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        *out++ = value ? (byte | 0x80) : byte;
+    } while (value);
+    return out;
+}
+
+static const uint8_t* get_varint(const uint8_t* in, uint32_t& value) {
+    value = 0;
+    for (int shift = 0; ; shift += 7) {
+        uint8_t byte = *in++;
+        value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return in;
+        }
+    }
+}
+
+static uint64_t word(const uint8_t* bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+Rewind::Rewind(size_t capacity, uint32_t keyframe_interval)
+    : ring(capacity), head(0), used(0), keyframe_interval(keyframe_interval ? keyframe_interval : 1), since_keyframe(0),
+      current(Chip8::STATE_SIZE), next(Chip8::STATE_SIZE), scratch(MAX_ENTRY_SIZE) {
+    if (capacity < 2 * MAX_ENTRY_SIZE) {
+        throw std::runtime_error("Rewind buffer too small");
+    }
+}
+
+uint32_t Rewind::encode(const uint8_t* state, const uint8_t* base, uint8_t* out) {
+    // Runs of (zero bytes, literal bytes), the XOR of two close states is almost all zero
+    uint8_t* start = out;
+    size_t i = 0;
+
+    while (i < Chip8::STATE_SIZE) {
+        size_t zeros = i;
+        while (zeros + 8 <= Chip8::STATE_SIZE && word(state + zeros) == (base ? word(base + zeros) : 0)) {
+            zeros += 8; // Unchanged pages and rows are skipped a word at a time
+        }
+        while (zeros < Chip8::STATE_SIZE && (state[zeros] ^ (base ? base[zeros] : 0)) == 0) {
+            ++zeros;
+        }
+
+        size_t literals = zeros;
+        while (literals < Chip8::STATE_SIZE) {
+            // A literal run ends at two zero bytes in a row, one costs less inside the run
+            bool zero = (state[literals] ^ (base ? base[literals] : 0)) == 0;
+            bool zero_next = literals + 1 >= Chip8::STATE_SIZE || (state[literals + 1] ^ (base ? base[literals + 1] : 0)) == 0;
+            if (zero && zero_next) {
+                break;
+            }
+            ++literals;
+        }
+
+        out = put_varint(out, zeros - i);
+        out = put_varint(out, literals - zeros);
+        for (size_t j = zeros; j < literals; ++j) {
+            *out++ = state[j] ^ (base ? base[j] : 0);
+        }
+        i = literals;
+    }
+    return out - start;
+}
+
+void Rewind::decode(const uint8_t* data, uint8_t* state) {
+    size_t i = 0;
+    while (i < Chip8::STATE_SIZE) {
+        uint32_t zeros;
+        uint32_t literals;
+        data = get_varint(data, zeros);
+        data = get_varint(data, literals);
+        i += zeros;
+        for (uint32_t j = 0; j < literals; ++j) {
+            state[i++] ^= *data++;
+        }
+    }
+}
+
+uint8_t* Rewind::reserve(uint32_t size) {
+    if (head + size > ring.size()) { // Wrap, the oldest entries sit between head and the end
+        while (!entries.empty() && entries.front().offset >= head) {
+            used -= entries.front().size;
+            entries.pop_front();
+        }
+        head = 0;
+    }
+
+    // Evict whatever the new entry overwrites, then any deltas left without their keyframe
+    while (!entries.empty() && entries.front().offset >= head && entries.front().offset < head + size) {
+        used -= entries.front().size;
+        entries.pop_front();
+    }
+    while (!entries.empty() && !entries.front().keyframe) {
+        used -= entries.front().size;
+        entries.pop_front();
+    }
+
+    uint8_t* out = &ring[head];
+    head += size;
+    used += size;
+    return out;
+}
+
+void Rewind::push(Chip8& emulator) {
+    emulator.save_state(next.data());
+
+    bool keyframe = entries.empty() || since_keyframe + 1 >= keyframe_interval;
+    uint32_t size = encode(next.data(), keyframe ? nullptr : current.data(), scratch.data());
+
+    uint8_t* out = reserve(size);
+    if (!keyframe && entries.empty()) { // Eviction took the delta's keyframe, store a full state instead
+        head -= size;
+        used -= size;
+        keyframe = true;
+        size = encode(next.data(), nullptr, scratch.data());
+        out = reserve(size);
+    }
+    memcpy(out, scratch.data(), size);
+    entries.push_back({head - size, size, keyframe});
+    since_keyframe = keyframe ? 0 : since_keyframe + 1;
+
+    current.swap(next);
+}
+
+bool Rewind::rewind(Chip8& emulator, size_t frames) {
+    if (entries.empty()) {
+        return false;
+    }
+    if (frames >= entries.size()) {
+        frames = entries.size() - 1; // Oldest frame held
+    }
+    size_t target = entries.size() - 1 - frames;
+
+    size_t keyframe = target;
+    while (!entries[keyframe].keyframe) {
+        --keyframe;
+    }
+
+    memset(current.data(), 0, current.size());
+    for (size_t i = keyframe; i <= target; ++i) {
+        decode(&ring[entries[i].offset], current.data());
+    }
+    emulator.load_state(current.data(), current.size());
+
+    while (entries.size() > target + 1) {
+        used -= entries.back().size;
+        entries.pop_back();
+    }
+    head = entries.back().offset + entries.back().size;
+    since_keyframe = target - keyframe;
+    return true;
+}
+
+void Rewind::clear() {
+    entries.clear();
+    head = 0;
+    used = 0;
+    since_keyframe = 0;
+}
+
+size_t Rewind::size() const {
+    return entries.size();
+}
+
+size_t Rewind::bytes() const {
+    return used;
+}
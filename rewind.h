@@ -0,0 +1,45 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "chip8.h"
+#include <deque>
+
+// Rewind history, one entry per frame in a fixed size byte ring.
+// Most entries are the XOR of the frame's save state with the previous one, zero run length encoded,
+// so untouched memory pages and framebuffer rows cost a few bytes. Every keyframe_interval frames a
+// full state is stored instead, rewinding decodes the nearest keyframe and applies deltas forward.
+class Rewind {
+  public:
+    Rewind(size_t capacity = 8 << 20, uint32_t keyframe_interval = 300); // 8 MB, a keyframe every 5 seconds
+
+    void push(Chip8& emulator); // Call once per frame, constant cost
+    bool rewind(Chip8& emulator, size_t frames = 1); // Restores the state that many frames back and drops the newer ones
+    void clear();
+
+    size_t size() const; // Frames held, the oldest one is always a keyframe
+    size_t bytes() const; // Encoded bytes held
+
+  private:
+    struct Entry {
+        size_t offset; // In ring
+        uint32_t size;
+        bool keyframe;
+    };
+
+    uint8_t* reserve(uint32_t size); // Space for a new entry, evicting the oldest ones
+    static uint32_t encode(const uint8_t* state, const uint8_t* base, uint8_t* out); // base may be nullptr for a keyframe
+    static void decode(const uint8_t* data, uint8_t* state); // XORs into state
+
+    std::vector<uint8_t> ring;
+    std::deque<Entry> entries;
+    size_t head; // Where the next entry goes
+    size_t used;
+    uint32_t keyframe_interval;
+    uint32_t since_keyframe;
+
+    std::vector<uint8_t> current; // Newest state pushed
+    std::vector<uint8_t> next;
+    std::vector<uint8_t> scratch; // Encoded entry before it goes into the ring
+};
+
+#endif
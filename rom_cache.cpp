@@ -0,0 +1,107 @@
+#include "rom_cache.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define ROM_CACHE_MMAP 1
+#endif
+
+static constexpr size_t MAX_ROM_SIZE = 0x1000 - 0x200;
+
+RomImage::RomImage(const std::string& path) : bytes(nullptr), length(0), fnv(0), mapped(false) {
+#ifdef ROM_CACHE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open rom");
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw std::runtime_error("Failed to read ROM");
+    }
+    length = info.st_size;
+    if (length == 0) {
+        close(fd);
+        throw std::runtime_error("ROM is empty");
+    }
+    if (length > MAX_ROM_SIZE) {
+        close(fd);
+        throw std::runtime_error("Size of rom too large");
+    }
+
+    void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Failed to read ROM");
+    }
+    bytes = static_cast<const uint8_t*>(address);
+    mapped = true;
+    close(fd); // The mapping stays valid
+#else
+    std::ifstream rom(path, std::ios::binary | std::ios::ate);
+    if (!rom) {
+        throw std::runtime_error("Failed to open rom");
+    }
+    std::streamsize size = rom.tellg();
+    if (size == 0) {
+        throw std::runtime_error("ROM is empty");
+    }
+    if (size > static_cast<std::streamsize>(MAX_ROM_SIZE)) {
+        throw std::runtime_error("Size of rom too large");
+    }
+    copy.resize(size);
+    rom.seekg(0, std::ios::beg);
+    if (!rom.read(reinterpret_cast<char*>(copy.data()), size)) {
+        throw std::runtime_error("Failed to read ROM");
+    }
+    length = copy.size();
+#endif
+    if (!mapped) {
+        bytes = copy.data();
+    }
+
+    fnv = fnv1a(bytes, length);
+}
+
+RomImage::~RomImage() {
+#ifdef ROM_CACHE_MMAP
+    if (mapped) {
+        munmap(const_cast<uint8_t*>(bytes), length);
+    }
+#endif
+}
+
+const uint8_t* RomImage::data() const {
+    return bytes;
+}
+
+size_t RomImage::size() const {
+    return length;
+}
+
+uint64_t RomImage::hash() const {
+    return fnv;
+}
+
+std::shared_ptr<const RomImage> RomCache::get(const std::string& path) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<const RomImage>& image = images[path];
+    if (!image) {
+        try {
+            image = std::make_shared<const RomImage>(path);
+        }
+        catch (...) {
+            images.erase(path); // Not cached, the next call tries again
+            throw;
+        }
+    }
+    return image;
+}
+
+void RomCache::load(Chip8& emulator, const std::string& path) {
+    std::shared_ptr<const RomImage> image = get(path);
+    emulator.load_rom(image->data(), image->size(), image->hash()); // Hashed once, when the file was mapped
+}
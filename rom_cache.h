@@ -0,0 +1,39 @@
+#ifndef ROM_CACHE_H
+#define ROM_CACHE_H
+
+#include "chip8.h"
+#include <mutex>
+#include <unordered_map>
+
+// A ROM file mapped read-only once, shared by every emulator that runs it
+class RomImage {
+  public:
+    RomImage(const std::string& path); // Maps and validates, throws like load_game
+    ~RomImage();
+    RomImage(const RomImage&) = delete;
+    RomImage& operator=(const RomImage&) = delete;
+
+    const uint8_t* data() const;
+    size_t size() const;
+    uint64_t hash() const; // FNV-1a of the file, same as rom_hash() in replay.h
+
+  private:
+    const uint8_t* bytes;
+    size_t length;
+    uint64_t fnv;
+    bool mapped; // Otherwise bytes points into copy
+    std::vector<uint8_t> copy; // Hosts without mmap
+};
+
+// Images by path, safe to use from several threads. Loading a cached ROM is one copy into memory[0x200]
+class RomCache {
+  public:
+    std::shared_ptr<const RomImage> get(const std::string& path);
+    void load(Chip8& emulator, const std::string& path); // get() then load_rom() with the cached hash
+
+  private:
+    std::mutex lock;
+    std::unordered_map<std::string, std::shared_ptr<const RomImage>> images;
+};
+
+#endif